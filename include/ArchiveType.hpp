@@ -2,6 +2,13 @@
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <VM/Interpreter.hpp>
 
 enum OpenMode
@@ -12,10 +19,116 @@ enum OpenMode
 
 using namespace fer;
 
+// One step of setting up a libarchive handle (a filter, format or option), kept by the archive to
+// set up the handle again on reset().
+using ArchiveSetupFn = std::function<int(archive *a)>;
+
+class ArchiveMount;
+
+// Counters of the work done through an archive, updated by the native operations (including
+// their worker threads). Times are in nanoseconds and are summed across threads.
+struct ArchiveStats
+{
+	std::atomic<uint64_t> entries;
+	// entry data read from or written to the archive
+	std::atomic<uint64_t> bytes;
+	// inside libarchive read/write calls: formats, filters and the I/O callbacks
+	std::atomic<uint64_t> archiveNs;
+	// inside the module's own I/O callbacks (memory, mmap and seekable archives)
+	std::atomic<uint64_t> ioNs;
+	// reading files from disk (add*) or writing them to disk (extract)
+	std::atomic<uint64_t> diskNs;
+
+	// installed by the module for the duration of a call, invoked from the calling thread only
+	std::function<bool()> progress;
+	uint64_t progressNext;
+
+	ArchiveStats();
+
+	// call from the calling thread after updating `bytes`; false means the progress callback
+	// asked to stop
+	inline bool report() { return !progress || bytes < progressNext || progress(); }
+	void reset();
+};
+
+// A regular file whose data was stored by a writer, for content deduplication.
+struct ArchiveContent
+{
+	la_int64_t size;
+	// name in the archive, used as hardlink target
+	std::string pathname;
+	// file on disk, compared against candidates before linking them
+	std::string sourcepath;
+};
+
+// State behind custom libarchive open callbacks (memory buffers, mapped files, ...).
+// Owned by the archive and destroyed only after the libarchive handle is freed.
+class ArchiveClient
+{
+protected:
+	// stats of the owning archive, for timing the I/O callbacks
+	ArchiveStats *stats;
+
+public:
+	ArchiveClient() : stats(nullptr) {}
+	virtual ~ArchiveClient() = default;
+
+	inline void setStats(ArchiveStats *archiveStats) { stats = archiveStats; }
+
+	// called by the module before each header is written to the archive
+	virtual int beforeHeader(archive *a, archive_entry *entry) { return ARCHIVE_OK; }
+	// true if the I/O callbacks call Feral functions, which only the calling thread may do
+	virtual bool callsFeral() const { return false; }
+};
+
+// Checksums of the entries written to an archive, kept from header to header until it is closed.
+class ArchiveChecksums
+{
+public:
+	virtual ~ArchiveChecksums() = default;
+
+	// called by the module when an entry's header is written
+	virtual void beginEntry(archive_entry *entry) = 0;
+	// called by the module with the entry data, in order
+	virtual void update(const void *data, size_t len) = 0;
+	// called when the archive is reset, to start over for its next output
+	virtual void restart() = 0;
+};
+
 class VarArchive : public Var
 {
 	archive *val;
+	ArchiveClient *client;
+	// writers: per-entry checksums, or nullptr
+	ArchiveChecksums *checksums;
+	archive_entry_linkresolver *links;
+	// content hash -> stored regular files, filled by add* with dedup = true
+	std::unordered_multimap<uint64_t, ArchiveContent> contents;
+	// file the archive was opened from, empty for other sources
+	std::string path;
+	ArchiveStats stats;
+	// Feral function called with (bytes, entries) every progressEvery bytes, or nullptr
+	Var *progressFn;
+	uint64_t progressEvery;
 	OpenMode mode;
+	// bumped whenever libarchive may invalidate the last data block handed out: on reads, and
+	// when the handle or its client is closed or replaced
+	size_t readGen;
+	// readGen of the current handle before anything was read from it
+	size_t firstGen;
+	// zip writers: choose store or deflate for each entry from a sample of its data
+	bool adaptive;
+	// filters, format and options applied to the handle, in order
+	std::vector<ArchiveSetupFn> setup;
+	// ids of the formats and filters among them
+	std::vector<int> formats;
+	std::vector<int> filters;
+	// read buffer of the module's file sources, kept across reset() to avoid reallocating it
+	std::vector<char> readBuf;
+	// set while an async task uses the handle, shared with the copies of the archive
+	std::shared_ptr<std::atomic<bool>> busy;
+	// set once an open*() reached libarchive, which opens a handle only once; shared like busy
+	std::shared_ptr<bool> opened;
 	bool owner;
 
 public:
@@ -25,8 +138,51 @@ public:
 	Var *copy(ModuleLoc loc);
 	void set(Var *from);
 
+	// takes ownership of newClient, deleting the previous one
+	void setClient(ArchiveClient *newClient);
+	// takes ownership of newChecksums (nullptr to stop computing them), deleting the previous one
+	void setChecksums(ArchiveChecksums *newChecksums);
+	// replaces the progress callback (nullptr to remove it)
+	void setProgress(Var *fn, uint64_t every);
+	// hardlink resolver for writers, created on first use with the archive's format strategy
+	archive_entry_linkresolver *getLinkResolver();
+	// applies the step to the handle, keeping it for reset() unless it failed
+	int applySetup(const ArchiveSetupFn &step);
+	// true if the handle was set up for the zip format alone, without filters, so that zip
+	// files may be read directly instead of through the handle
+	bool isZipOnly() const;
+	// replaces the handle with a new one set up like the current one, ready to be opened again;
+	// returns false if libarchive could not allocate it
+	bool reset();
+
 	inline archive *const get() { return val; }
+	inline ArchiveClient *getClient() { return client; }
+	inline ArchiveChecksums *getChecksums() { return checksums; }
+	inline bool hasLinkResolver() const { return links != nullptr; }
+	inline std::unordered_multimap<uint64_t, ArchiveContent> &getContents() { return contents; }
+	inline std::vector<char> &getReadBuffer() { return readBuf; }
+	inline void setPath(const std::string &newPath) { path = newPath; }
+	inline void setAdaptive(bool isAdaptive) { adaptive = isAdaptive; }
+	inline bool isAdaptive() const { return adaptive; }
+	inline const std::string &getPath() const { return path; }
+	inline ArchiveStats &getStats() { return stats; }
+	inline Var *getProgressFn() { return progressFn; }
+	inline uint64_t getProgressEvery() const { return progressEvery; }
 	inline const OpenMode &getMode() const { return mode; }
+	inline size_t getReadGen() const { return readGen; }
+	inline size_t nextReadGen() { return ++readGen; }
+	// true until the first read from the current handle
+	inline bool isUnread() const { return readGen == firstGen; }
+	inline const std::vector<ArchiveSetupFn> &getSetup() const { return setup; }
+	inline void addSetupFormat(int format) { formats.push_back(format); }
+	inline void addSetupFilter(int filter) { filters.push_back(filter); }
+	inline bool isBusy() const { return *busy; }
+	inline void setBusy(bool isBusy) { *busy = isBusy; }
+	inline bool isOwner() const { return owner; }
+	inline bool isOpened() const { return *opened; }
+	inline void setOpened() { *opened = true; }
+	// copies share the handle, the client and the busy flag of the original
+	inline bool hasCopies() const { return busy.use_count() > 1; }
 };
 
 class VarArchiveEntry : public Var
@@ -43,3 +199,83 @@ public:
 
 	inline archive_entry *const get() { return val; }
 };
+
+// Read-only view of a data block read from an archive. The memory belongs to libarchive and is
+// valid only until the next read from the same archive, or until it is closed or reset.
+class VarArchiveBlock : public Var
+{
+	VarArchive *ar;
+	const char *data;
+	size_t len;
+	la_int64_t offset;
+	size_t gen;
+
+public:
+	VarArchiveBlock(ModuleLoc loc, VarArchive *ar, const void *data, size_t len,
+			la_int64_t offset);
+	~VarArchiveBlock();
+
+	Var *copy(ModuleLoc loc);
+	void set(Var *from);
+
+	inline bool isValid() const { return gen == ar->getReadGen(); }
+	inline const char *getData() const { return data; }
+	inline size_t getLen() const { return len; }
+	inline la_int64_t getOffset() const { return offset; }
+};
+
+// State of a native operation running on its own thread, shared by the copies of its task.
+struct ArchiveTaskState
+{
+	VarArchive *ar;
+	// second archive used by the operation (the reader of a transcode), or nullptr
+	VarArchive *source;
+	std::thread worker;
+	// asks the operation to stop at the next entry or block
+	std::function<void()> canceller;
+	std::atomic<bool> done;
+	int code;
+	std::vector<std::string> errors;
+	bool reported;
+
+	ArchiveTaskState(VarArchive *ar, VarArchive *source);
+	// cancels the operation if it is still running
+	~ArchiveTaskState();
+
+	// joins the finished worker and releases the archive for other calls
+	void join();
+};
+
+// Handle of an async operation. The operation only uses native state: the archive's libarchive
+// handle and atomic stats, never Feral objects, and the archive refuses other calls meanwhile.
+class VarArchiveTask : public Var
+{
+	std::shared_ptr<ArchiveTaskState> state;
+
+public:
+	VarArchiveTask(ModuleLoc loc, VarArchive *ar, VarArchive *source = nullptr);
+	VarArchiveTask(ModuleLoc loc, std::shared_ptr<ArchiveTaskState> state);
+
+	Var *copy(ModuleLoc loc);
+	void set(Var *from);
+
+	// runs op on the worker thread; op returns the libarchive code and appends its errors
+	void start(std::function<int(std::vector<std::string> &errors)> op,
+		   std::function<void()> canceller);
+
+	inline ArchiveTaskState &getState() { return *state; }
+};
+
+// Handle of a mounted archive, see ArchiveMount. Copies share the index and the cache.
+class VarArchiveMount : public Var
+{
+	std::shared_ptr<ArchiveMount> mount;
+
+public:
+	VarArchiveMount(ModuleLoc loc, std::shared_ptr<ArchiveMount> mount);
+
+	Var *copy(ModuleLoc loc);
+	void set(Var *from);
+
+	inline ArchiveMount &get() { return *mount; }
+};
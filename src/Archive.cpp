@@ -1,11 +1,21 @@
 #include <fcntl.h>
 #include <std/BytebufferType.hpp>
 
+#include "ArchiveBlock.hpp"
+#include "ArchiveChecksum.hpp"
+#include "ArchiveDisk.hpp"
 #include "ArchiveEntry.hpp"
+#include "ArchiveExtract.hpp"
 #include "ArchiveFilters.hpp"
 #include "ArchiveFormats.hpp"
-
-static int copyData(struct archive *ar, struct archive *aw);
+#include "ArchiveIO.hpp"
+#include "ArchiveList.hpp"
+#include "ArchiveMount.hpp"
+#include "ArchiveSeekable.hpp"
+#include "ArchiveStats.hpp"
+#include "ArchiveTask.hpp"
+#include "ArchiveTranscode.hpp"
+#include "ArchiveVolume.hpp"
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////// Functions ////////////////////////////////////////////
@@ -34,29 +44,93 @@ Var *feralArchiveNew(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 	return vm.makeVar<VarArchive>(loc, a, mode);
 }
 
+// open(name, blockSize = 10240, volumeSize = 0)
+// Readers also take a vector of volume names, read in order as one archive. Writers with
+// volumeSize > 0 split their output into volumes name.001, name.002, ... of that many bytes.
 Var *feralArchiveOpen(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 		      const StringMap<AssnArgData> &assn_args)
 {
 	VarArchive *ar = as<VarArchive>(args[0]);
 	archive *a     = ar->get();
 
-	if(!args[1]->is<VarStr>()) {
+	std::vector<std::string> volumes;
+	if(args[1]->is<VarVec>() && ar->getMode() == OM_READ) {
+		for(auto &v : as<VarVec>(args[1])->get()) {
+			if(!v->is<VarStr>()) {
+				vm.fail(v->getLoc(), "expected volume names to be of type 'str', found: ",
+					vm.getTypeName(v));
+				return nullptr;
+			}
+			volumes.push_back(as<VarStr>(v)->get());
+		}
+		if(volumes.empty()) {
+			vm.fail(args[1]->getLoc(), "expected at least one volume to open as archive");
+			return nullptr;
+		}
+	} else if(!args[1]->is<VarStr>()) {
 		vm.fail(args[1]->getLoc(), "expected a string file name to open as archive");
 		return nullptr;
 	}
 
-	const std::string &name = as<VarStr>(args[1])->get();
-	int code		= ARCHIVE_OK;
+	// reader: bytes requested per read() call, writer: output is padded/blocked to this size
+	int64_t blockSize  = 10240;
+	int64_t volumeSize = 0;
+	if(!assnArgInt(vm, assn_args, "blockSize", blockSize) ||
+	   !assnArgInt(vm, assn_args, "volumeSize", volumeSize))
+	{
+		return nullptr;
+	}
+	if(blockSize <= 0) {
+		vm.fail(loc, "block size must be positive, found: ", blockSize);
+		return nullptr;
+	}
+	if(volumeSize < 0 || (volumeSize > 0 && ar->getMode() != OM_WRITE)) {
+		vm.fail(loc, "volume size must be positive, and is only used by writers");
+		return nullptr;
+	}
 
+	ar->setOpened();
+	int code = ARCHIVE_OK;
+	if(!volumes.empty()) {
+		VolumeSource *src = new VolumeSource(volumes, ar->getReadBuffer(), blockSize);
+		ar->setClient(src);
+		code = archive_read_open2(a, src, VolumeSource::open, VolumeSource::read,
+					  VolumeSource::skip, nullptr);
+		if(code != ARCHIVE_OK) {
+			vm.fail(loc, "failed to open archive in given mode: ", archive_error_string(a));
+			return nullptr;
+		}
+		return args[0];
+	}
+
+	const std::string &name = as<VarStr>(args[1])->get();
 	if(ar->getMode() == OM_READ) {
-		code = archive_read_open_filename(a, name.c_str(), 10240);
+		int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd >= 0) {
+			FileSource *src = new FileSource(fd, ar->getReadBuffer(), blockSize);
+			ar->setClient(src);
+			code = src->open(a);
+		} else {
+			// reports the error through libarchive
+			code = archive_read_open_filename(a, name.c_str(), blockSize);
+		}
+	} else if(ar->getMode() == OM_WRITE && volumeSize > 0) {
+		archive_write_set_bytes_per_block(a, blockSize);
+		// the volumes hold exactly the archive, without padding at the end
+		archive_write_set_bytes_in_last_block(a, 1);
+		VolumeSink *sink = new VolumeSink(name, volumeSize);
+		ar->setClient(sink);
+		code = archive_write_open(a, sink, nullptr, VolumeSink::write, VolumeSink::close);
 	} else if(ar->getMode() == OM_WRITE) {
+		archive_write_set_bytes_per_block(a, blockSize);
 		code = archive_write_open_filename(a, name.c_str());
 	}
 	if(code != ARCHIVE_OK) {
 		vm.fail(loc, "failed to open archive in given mode");
 		return nullptr;
 	}
+	// volumes are not one file that could be read from directly
+	if(volumeSize == 0) ar->setPath(name);
 	return args[0];
 }
 
@@ -64,20 +138,66 @@ Var *feralArchiveClose(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 		       const StringMap<AssnArgData> &assn_args)
 {
 	VarArchive *ar = as<VarArchive>(args[0]);
+	// closing frees the filter and client buffers that blocks point into
+	ar->nextReadGen();
 	if(ar->getMode() == OM_READ) archive_read_close(ar->get());
-	else if(ar->getMode() == OM_WRITE) archive_write_close(ar->get());
+	else if(ar->getMode() == OM_WRITE) {
+		ArchiveStatus status;
+		bool ok = flushDiskLinks(ar, status);
+		if(ok) ok = writeChecksumManifest(ar, status);
+		archive_write_close(ar->get());
+		if(!ok) {
+			for(auto &err : status.errors) vm.fail(loc, err);
+			return nullptr;
+		}
+	}
+	return args[0];
+}
+
+// reset()
+// Closes the archive and replaces its handle with a new one, with the same filters, format and
+// options, so that it can be opened again without setting it up. The read buffer, stats and
+// progress callback are kept. Only the archive itself can be reset, not copies of it, and not
+// while copies exist since they would be left with the freed handle.
+Var *feralArchiveReset(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+		       const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	if(!ar->isOwner()) {
+		vm.fail(loc, "only the original archive can be reset, not a copy of it");
+		return nullptr;
+	}
+	if(ar->hasCopies()) {
+		vm.fail(loc, "cannot reset an archive while copies of it are in use");
+		return nullptr;
+	}
+	if(!ar->reset()) {
+		vm.fail(loc, "failed to init archive object");
+		return nullptr;
+	}
 	return args[0];
 }
 
 Var *feralArchiveWriteHeader(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 			     const StringMap<AssnArgData> &assn_args)
 {
-	if(!args[1]->is<VarArchiveEntry>()) {
+	if(!args[1]->is<VarArchiveEntry>() && !args[1]->is<VarMap>()) {
 		vm.fail(args[1]->getLoc(),
-			"expected an archive entry for header, found: ", vm.getTypeName(args[1]));
+			"expected an archive entry or a map of its fields for header, found: ",
+			vm.getTypeName(args[1]));
 		return nullptr;
 	}
-	archive_write_header(as<VarArchive>(args[0])->get(), as<VarArchiveEntry>(args[1])->get());
+	VarArchive *ar = as<VarArchive>(args[0]);
+	// a map is turned into an entry in one call, instead of one call per field
+	EntryPtr fields;
+	if(args[1]->is<VarMap>()) {
+		fields.reset(archive_entry_new());
+		if(!fillEntry(vm, as<VarMap>(args[1]), fields.get(), nullptr)) return nullptr;
+	}
+	archive_entry *e = fields ? fields.get() : as<VarArchiveEntry>(args[1])->get();
+	// the data is not known yet, so adaptive zip writers deflate it
+	if(ar->isAdaptive()) chooseZipCompression(ar->get(), e, nullptr, 0, -1);
+	writeArchiveHeader(ar, e);
 	return args[0];
 }
 
@@ -89,84 +209,109 @@ Var *feralArchiveWriteData(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 			vm.getTypeName(args[1]));
 		return nullptr;
 	}
-	archive_write_data(as<VarArchive>(args[0])->get(), as<VarBytebuffer>(args[1])->getBuf(),
-			   as<VarBytebuffer>(args[1])->len());
+	VarArchive *ar	  = as<VarArchive>(args[0]);
+	VarBytebuffer *bb = as<VarBytebuffer>(args[1]);
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	if(!writeArchiveData(ar, bb->getBuf(), bb->len(), status)) {
+		for(auto &err : status.errors) vm.fail(loc, err);
+		return nullptr;
+	}
+	if(!ar->getStats().report()) {
+		vm.fail(loc, "stopped by progress callback");
+		return nullptr;
+	}
 	return args[0];
 }
 
-Var *feralArchiveAddFile(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
-			 const StringMap<AssnArgData> &assn_args)
+// returns a copy of the next entry, or nil at the end of the archive
+// the copy stays valid after the following nextHeader(), reset() or the archive's end
+Var *feralArchiveNextHeader(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			    const StringMap<AssnArgData> &assn_args)
 {
-	if(!args[1]->is<VarStr>()) {
-		vm.fail(args[1]->getLoc(), "expected a file name to write in archive");
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+	archive_entry *entry;
+	ar->nextReadGen();
+	int code = timed(ar->getStats().archiveNs, [&] { return archive_read_next_header(a, &entry); });
+	if(code == ARCHIVE_EOF) return vm.getNil();
+	if(code < ARCHIVE_WARN) {
+		vm.fail(loc, "read_next_header failed: ", archive_error_string(a));
 		return nullptr;
 	}
-	VarArchive *ar		    = as<VarArchive>(args[0]);
-	archive *a		    = ar->get();
-	const std::string &filename = as<VarStr>(args[1])->get();
-
-	struct stat st;
-	stat(filename.c_str(), &st);
-	archive_entry *entry = archive_entry_new();
-	archive_entry_set_pathname(entry, filename.c_str());
-	archive_entry_set_size(entry, st.st_size);
-	archive_entry_set_filetype(entry, AE_IFREG);
-	archive_entry_set_perm(entry, st.st_mode);
-	archive_write_header(a, entry);
-	int fdesc = open(filename.c_str(), O_RDONLY);
-	char buff[8192];
-	int len;
-	while((len = read(fdesc, buff, sizeof(buff))) > 0) {
-		archive_write_data(a, buff, len);
-	}
-	close(fdesc);
-	archive_entry_free(entry);
-	return args[0];
+	++ar->getStats().entries;
+	return vm.makeVar<VarArchiveEntry>(loc, archive_entry_clone(entry), true);
 }
 
-Var *feralArchiveExtract(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
-			 const StringMap<AssnArgData> &assn_args)
+// returns a view of the next data block of the current entry, or nil at the end of the entry
+Var *feralArchiveReadBlock(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			   const StringMap<AssnArgData> &assn_args)
 {
 	VarArchive *ar = as<VarArchive>(args[0]);
 	archive *a     = ar->get();
-	int extract_flags =
-	ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_FFLAGS;
-	archive *ext = archive_write_disk_new();
-	archive_entry *entry;
-	archive_write_disk_set_options(ext, extract_flags);
-	archive_write_disk_set_standard_lookup(ext);
-	int code = ARCHIVE_OK;
-	for(;;) {
-		code = archive_read_next_header(a, &entry);
-		if(code == ARCHIVE_EOF) break;
-		if(code < ARCHIVE_OK) {
-			vm.fail(loc,
-				"extract - read_next_header failed: ", archive_error_string(a));
-			// goto end done by code < ARCHIVE_WARN
-		}
-		if(code < ARCHIVE_WARN) goto end;
-		code = archive_write_header(ext, entry);
-		if(code < ARCHIVE_OK) {
-			vm.fail(loc, "extract - writer_header failed: ", archive_error_string(ext));
-		} else if(archive_entry_size(entry) > 0) {
-			code = copyData(a, ext);
-			if(code < ARCHIVE_OK) {
-				vm.fail(loc,
-					"extract - copyData failed: ", archive_error_string(ext));
-			}
-			if(code < ARCHIVE_WARN) goto end;
-		}
-		code = archive_write_finish_entry(ext);
-		if(code < ARCHIVE_OK) {
-			vm.fail(loc,
-				"extract - write_finish_entry failed: ", archive_error_string(ext));
-		}
-		if(code < ARCHIVE_WARN) goto end;
+	const void *buff;
+	size_t size;
+	la_int64_t offset;
+	ArchiveStats &stats = ar->getStats();
+	ProgressScope progress(vm, loc, ar);
+	ar->nextReadGen();
+	int code = timed(stats.archiveNs,
+			 [&] { return archive_read_data_block(a, &buff, &size, &offset); });
+	if(code == ARCHIVE_EOF) return vm.getNil();
+	if(code < ARCHIVE_WARN) {
+		vm.fail(loc, "read_data_block failed: ", archive_error_string(a));
+		return nullptr;
 	}
-end:
-	archive_write_close(ext);
-	archive_write_free(ext);
-	return vm.makeVar<VarInt>(loc, code);
+	stats.bytes += size;
+	if(!stats.report()) {
+		vm.fail(loc, "stopped by progress callback");
+		return nullptr;
+	}
+	return vm.makeVar<VarArchiveBlock>(loc, ar, buff, size, offset);
+}
+
+// fills the bytebuffer (up to its capacity) with the current entry's data, returns bytes read
+Var *feralArchiveReadData(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarBytebuffer>()) {
+		vm.fail(args[1]->getLoc(), "expected a bytebuffer to read data into, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	VarArchive *ar	  = as<VarArchive>(args[0]);
+	VarBytebuffer *bb = as<VarBytebuffer>(args[1]);
+	ArchiveStats &stats = ar->getStats();
+	ProgressScope progress(vm, loc, ar);
+	ar->nextReadGen();
+	la_ssize_t len = timed(stats.archiveNs, [&] {
+		return archive_read_data(ar->get(), bb->getBuf(), bb->capacity());
+	});
+	if(len < 0) {
+		vm.fail(loc, "read_data failed: ", archive_error_string(ar->get()));
+		return nullptr;
+	}
+	stats.bytes += len;
+	if(!stats.report()) {
+		vm.fail(loc, "stopped by progress callback");
+		return nullptr;
+	}
+	bb->setLen(len);
+	return vm.makeVar<VarInt>(loc, len);
+}
+
+Var *feralArchiveSkipData(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	ar->nextReadGen();
+	if(timed(ar->getStats().archiveNs, [&] { return archive_read_data_skip(ar->get()); }) <
+	   ARCHIVE_WARN)
+	{
+		vm.fail(loc, "read_data_skip failed: ", archive_error_string(ar->get()));
+		return nullptr;
+	}
+	return args[0];
 }
 
 INIT_MODULE(Archive)
@@ -175,25 +320,85 @@ INIT_MODULE(Archive)
 
 	mod->addNativeFn("newArchive", feralArchiveNew, 1);
 	mod->addNativeFn("newEntry", feralArchiveEntryNew, 0);
+	mod->addNativeFn("transcode", feralArchiveTranscode, 2);
+	mod->addNativeFn("transcodeAsync", feralArchiveTranscodeAsync, 2);
 
-	vm.addNativeTypeFn<VarArchive>(loc, "open", feralArchiveOpen, 1);
-	vm.addNativeTypeFn<VarArchive>(loc, "close", feralArchiveClose, 0);
-	vm.addNativeTypeFn<VarArchive>(loc, "writeHeader", feralArchiveWriteHeader, 1);
-	vm.addNativeTypeFn<VarArchive>(loc, "writeData", feralArchiveWriteData, 1);
-	vm.addNativeTypeFn<VarArchive>(loc, "addFilter", feralArchiveApplyFilter, 1);
-	vm.addNativeTypeFn<VarArchive>(loc, "setFormat", feralArchiveApplyFormat, 1);
-	vm.addNativeTypeFn<VarArchive>(loc, "addFile", feralArchiveAddFile, 1);
-	vm.addNativeTypeFn<VarArchive>(loc, "extract", feralArchiveExtract, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "open", whenIdle<whenUnopened<feralArchiveOpen>>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "openMemory",
+				       whenIdle<whenUnopened<feralArchiveOpenMemory>>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "openMmap", whenIdle<whenUnopened<feralArchiveOpenMmap>>,
+				       1);
+	vm.addNativeTypeFn<VarArchive>(loc, "openFd", whenIdle<whenUnopened<feralArchiveOpenFd>>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "openCallback",
+				       whenIdle<whenUnopened<feralArchiveOpenCallback>>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "openSeekable",
+				       whenIdle<whenUnopened<feralArchiveOpenSeekable>>, 2);
+	vm.addNativeTypeFn<VarArchive>(loc, "openMember",
+				       whenIdle<whenUnopened<feralArchiveOpenMember>>, 2);
+	vm.addNativeTypeFn<VarArchive>(loc, "close", whenIdle<feralArchiveClose>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "reset", whenIdle<feralArchiveReset>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "writeHeader", whenIdle<feralArchiveWriteHeader>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "writeData", whenIdle<feralArchiveWriteData>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "writeDataFromFd", whenIdle<feralArchiveWriteDataFromFd>,
+				       1);
+	vm.addNativeTypeFn<VarArchive>(loc, "writeFile", whenIdle<feralArchiveWriteFile>, 2);
+	vm.addNativeTypeFn<VarArchive>(loc, "writeEntries", whenIdle<feralArchiveWriteEntries>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "nextHeader", whenIdle<feralArchiveNextHeader>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "readBlock", whenIdle<feralArchiveReadBlock>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "readData", whenIdle<feralArchiveReadData>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "skipData", whenIdle<feralArchiveSkipData>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "addFilter", whenIdle<feralArchiveApplyFilter>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "setFilterOption", whenIdle<feralArchiveSetFilterOption>,
+				       3);
+	vm.addNativeTypeFn<VarArchive>(loc, "setThreads", whenIdle<feralArchiveSetThreads>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "setChecksum", whenIdle<feralArchiveSetChecksum>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "setFormat", whenIdle<feralArchiveApplyFormat>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "addFile", whenIdle<feralArchiveAddFile>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "addTree", whenIdle<feralArchiveAddTree>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "addTreeAsync", whenIdle<feralArchiveAddTreeAsync>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "addFiles", whenIdle<feralArchiveAddFiles>, 1);
+	vm.addNativeTypeFn<VarArchive>(loc, "list", whenIdle<feralArchiveList>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "mount", whenIdle<feralArchiveMount>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "extract", whenIdle<feralArchiveExtract>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "extractAsync", whenIdle<feralArchiveExtractAsync>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "stats", whenIdle<feralArchiveStats>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "resetStats", whenIdle<feralArchiveResetStats>, 0);
+	vm.addNativeTypeFn<VarArchive>(loc, "setProgress", whenIdle<feralArchiveSetProgress>, 1);
 
 	vm.addNativeTypeFn<VarArchiveEntry>(loc, "clear", feralArchiveEntryClear, 0);
 	vm.addNativeTypeFn<VarArchiveEntry>(loc, "setPathname", feralArchiveEntrySetPathname, 1);
 	vm.addNativeTypeFn<VarArchiveEntry>(loc, "setSize", feralArchiveEntrySetSize, 1);
 	vm.addNativeTypeFn<VarArchiveEntry>(loc, "setFiletype", feralArchiveEntrySetFiletype, 1);
 	vm.addNativeTypeFn<VarArchiveEntry>(loc, "setPerm", feralArchiveEntrySetPerm, 1);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "setAll", feralArchiveEntrySetAll, 1);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "pathname", feralArchiveEntryGetPathname, 0);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "size", feralArchiveEntryGetSize, 0);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "filetype", feralArchiveEntryGetFiletype, 0);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "perm", feralArchiveEntryGetPerm, 0);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "mtime", feralArchiveEntryGetMtime, 0);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "symlink", feralArchiveEntryGetSymlink, 0);
+	vm.addNativeTypeFn<VarArchiveEntry>(loc, "hardlink", feralArchiveEntryGetHardlink, 0);
+
+	vm.addNativeTypeFn<VarArchiveBlock>(loc, "len", feralArchiveBlockLen, 0);
+	vm.addNativeTypeFn<VarArchiveBlock>(loc, "offset", feralArchiveBlockOffset, 0);
+	vm.addNativeTypeFn<VarArchiveBlock>(loc, "str", feralArchiveBlockStr, 0);
+	vm.addNativeTypeFn<VarArchiveBlock>(loc, "copyTo", feralArchiveBlockCopyTo, 1);
+
+	vm.addNativeTypeFn<VarArchiveTask>(loc, "poll", feralArchiveTaskPoll, 0);
+	vm.addNativeTypeFn<VarArchiveTask>(loc, "wait", feralArchiveTaskWait, 0);
+	vm.addNativeTypeFn<VarArchiveTask>(loc, "cancel", feralArchiveTaskCancel, 0);
+	vm.addNativeTypeFn<VarArchiveTask>(loc, "progress", feralArchiveTaskProgress, 0);
+
+	vm.addNativeTypeFn<VarArchiveMount>(loc, "readFile", feralArchiveMountReadFile, 1);
+	vm.addNativeTypeFn<VarArchiveMount>(loc, "stat", feralArchiveMountStat, 1);
+	vm.addNativeTypeFn<VarArchiveMount>(loc, "stats", feralArchiveMountStats, 0);
 
 	// register the archive types (registerType)
 	vm.registerType<VarArchive>(loc, "Archive");
 	vm.registerType<VarArchiveEntry>(loc, "ArchiveEntry");
+	vm.registerType<VarArchiveBlock>(loc, "ArchiveBlock");
+	vm.registerType<VarArchiveTask>(loc, "ArchiveTask");
+	vm.registerType<VarArchiveMount>(loc, "ArchiveMount");
 
 	// enums
 
@@ -236,6 +441,26 @@ INIT_MODULE(Archive)
 	mod->addNativeVar("FORMAT_7ZIP", vm.makeVar<VarInt>(loc, ARCHIVE_FORMAT_7ZIP));
 	mod->addNativeVar("FORMAT_WARC", vm.makeVar<VarInt>(loc, ARCHIVE_FORMAT_WARC));
 
+	mod->addNativeVar("EXTRACT_OWNER", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_OWNER));
+	mod->addNativeVar("EXTRACT_PERM", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_PERM));
+	mod->addNativeVar("EXTRACT_TIME", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_TIME));
+	mod->addNativeVar("EXTRACT_NO_OVERWRITE",
+			  vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_NO_OVERWRITE));
+	mod->addNativeVar("EXTRACT_UNLINK", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_UNLINK));
+	mod->addNativeVar("EXTRACT_ACL", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_ACL));
+	mod->addNativeVar("EXTRACT_FFLAGS", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_FFLAGS));
+	mod->addNativeVar("EXTRACT_XATTR", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_XATTR));
+	mod->addNativeVar("EXTRACT_SECURE_SYMLINKS",
+			  vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_SECURE_SYMLINKS));
+	mod->addNativeVar("EXTRACT_SECURE_NODOTDOT",
+			  vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_SECURE_NODOTDOT));
+	mod->addNativeVar("EXTRACT_SECURE_NOABSOLUTEPATHS",
+			  vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS));
+	mod->addNativeVar("EXTRACT_NO_AUTODIR", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_NO_AUTODIR));
+	mod->addNativeVar("EXTRACT_NO_OVERWRITE_NEWER",
+			  vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_NO_OVERWRITE_NEWER));
+	mod->addNativeVar("EXTRACT_SPARSE", vm.makeVar<VarInt>(loc, ARCHIVE_EXTRACT_SPARSE));
+
 	mod->addNativeVar("E_IFREG", vm.makeVar<VarInt>(loc, AE_IFREG));
 	mod->addNativeVar("E_IFDIR", vm.makeVar<VarInt>(loc, AE_IFDIR));
 	mod->addNativeVar("E_IFCHR", vm.makeVar<VarInt>(loc, AE_IFCHR));
@@ -244,21 +469,9 @@ INIT_MODULE(Archive)
 	mod->addNativeVar("E_IFLNK", vm.makeVar<VarInt>(loc, AE_IFLNK));
 	mod->addNativeVar("E_IFSOCK", vm.makeVar<VarInt>(loc, AE_IFSOCK));
 
+	mod->addNativeVar("CHECKSUM_NONE", vm.makeVar<VarInt>(loc, CHECKSUM_NONE));
+	mod->addNativeVar("CHECKSUM_CRC32C", vm.makeVar<VarInt>(loc, CHECKSUM_CRC32C));
+	mod->addNativeVar("CHECKSUM_XXH64", vm.makeVar<VarInt>(loc, CHECKSUM_XXH64));
+
 	return true;
 }
-
-static int copyData(struct archive *ar, struct archive *aw)
-{
-	int code;
-	const void *buff;
-	size_t size;
-	la_int64_t offset;
-
-	for(;;) {
-		code = archive_read_data_block(ar, &buff, &size, &offset);
-		if(code == ARCHIVE_EOF) return ARCHIVE_OK;
-		if(code < ARCHIVE_OK) return code;
-		code = archive_write_data_block(aw, buff, size, offset);
-		if(code < ARCHIVE_OK) return code;
-	}
-}
\ No newline at end of file
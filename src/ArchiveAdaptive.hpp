@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////// Adaptive Compression //////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// bytes sampled from the start of each file
+#define ADAPTIVE_SAMPLE_SIZE (64 << 10)
+// entries smaller than this are always stored
+#define ADAPTIVE_MIN_SIZE 64
+
+// Order-0 entropy of the sample in bits per byte: 8 for random, compressed or encrypted data.
+static double sampleEntropy(const char *data, size_t len)
+{
+	if(len == 0) return 0;
+	size_t counts[256] = {0};
+	for(size_t i = 0; i < len; ++i) ++counts[(unsigned char)data[i]];
+	double entropy = 0;
+	for(size_t count : counts) {
+		if(count == 0) continue;
+		double p = (double)count / len;
+		entropy -= p * std::log2(p);
+	}
+	return entropy;
+}
+
+// Reads up to ADAPTIVE_SAMPLE_SIZE bytes from the start of the entry's data, from the
+// prefetched contents, the open descriptor (without moving its offset), or the source path.
+static size_t sampleEntryData(archive_entry *e, const char *data, size_t dataLen, int fd,
+			      std::vector<char> &sample)
+{
+	sample.resize(ADAPTIVE_SAMPLE_SIZE);
+	if(data) {
+		size_t len = std::min(dataLen, sample.size());
+		memcpy(sample.data(), data, len);
+		return len;
+	}
+	bool own = fd < 0;
+	// entries written from Feral have no source to sample
+	if(own && !archive_entry_sourcepath(e)) return 0;
+	if(own) fd = open(archive_entry_sourcepath(e), O_RDONLY);
+	if(fd < 0) return 0;
+	ssize_t len = pread(fd, sample.data(), sample.size(), 0);
+	if(own) close(fd);
+	return len > 0 ? len : 0;
+}
+
+// Selects store or deflate for the next zip entry, which libarchive reads from the format
+// options when the header is written. Samples that look incompressible are stored, samples
+// with little to gain are deflated at the fastest level.
+static void chooseZipCompression(archive *a, archive_entry *e, const char *data, size_t dataLen,
+				 int fd)
+{
+	const char *method = "store";
+	const char *level  = nullptr;
+	if(archive_entry_filetype(e) == AE_IFREG && archive_entry_size(e) >= ADAPTIVE_MIN_SIZE) {
+		std::vector<char> sample;
+		size_t len     = sampleEntryData(e, data, dataLen, fd, sample);
+		double entropy = sampleEntropy(sample.data(), len);
+		if(len == 0 || entropy < 7.0) {
+			method = "deflate";
+			level  = "6";
+		} else if(entropy < 7.5) {
+			method = "deflate";
+			level  = "1";
+		}
+	}
+	archive_write_set_format_option(a, "zip", "compression", method);
+	// not supported by older libarchive versions, which keep their default level
+	if(level) archive_write_set_format_option(a, "zip", "compression-level", level);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <std/BytebufferType.hpp>
+
+#include "ArchiveType.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool checkBlockValid(Interpreter &vm, ModuleLoc loc, VarArchiveBlock *blk)
+{
+	if(blk->isValid()) return true;
+	vm.fail(loc, "archive block is no longer valid - the archive has been read from or closed"
+		     " since");
+	return false;
+}
+
+Var *feralArchiveBlockLen(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	return vm.makeVar<VarInt>(loc, as<VarArchiveBlock>(args[0])->getLen());
+}
+
+// offset of the block within the entry's data; blocks of sparse entries are not contiguous
+Var *feralArchiveBlockOffset(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			     const StringMap<AssnArgData> &assn_args)
+{
+	return vm.makeVar<VarInt>(loc, as<VarArchiveBlock>(args[0])->getOffset());
+}
+
+Var *feralArchiveBlockStr(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	VarArchiveBlock *blk = as<VarArchiveBlock>(args[0]);
+	if(!checkBlockValid(vm, loc, blk)) return nullptr;
+	return vm.makeVar<VarStr>(loc, std::string(blk->getData(), blk->getLen()));
+}
+
+// copies the block into an existing bytebuffer, so one buffer can be reused for every block
+Var *feralArchiveBlockCopyTo(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			     const StringMap<AssnArgData> &assn_args)
+{
+	VarArchiveBlock *blk = as<VarArchiveBlock>(args[0]);
+	if(!args[1]->is<VarBytebuffer>()) {
+		vm.fail(args[1]->getLoc(), "expected a bytebuffer to copy the block to, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	if(!checkBlockValid(vm, loc, blk)) return nullptr;
+	as<VarBytebuffer>(args[1])->setData((char *)blk->getData(), blk->getLen());
+	return args[1];
+}
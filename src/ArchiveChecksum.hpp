@@ -0,0 +1,331 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+#include "ArchiveHash.hpp"
+#include "ArchiveIncremental.hpp"
+#include "ArchiveUtils.hpp"
+
+// Member written last by writers with checksums enabled. One line per regular file entry:
+// escaped path, algorithm name and hex digest, tab separated.
+#define CHECKSUM_MEMBER ".feral-checksums"
+
+enum ChecksumAlgo
+{
+	CHECKSUM_NONE,
+	CHECKSUM_CRC32C,
+	CHECKSUM_XXH64,
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const char *checksumName(int algo) { return algo == CHECKSUM_CRC32C ? "crc32c" : "xxh64"; }
+
+static int checksumAlgo(const std::string &name)
+{
+	if(name == "crc32c") return CHECKSUM_CRC32C;
+	if(name == "xxh64") return CHECKSUM_XXH64;
+	return CHECKSUM_NONE;
+}
+
+// Checksum of one entry's data, over the data blocks as they pass through.
+class EntryHasher
+{
+	int algo;
+	CRC32C crc;
+	XXH64 xxh;
+
+public:
+	EntryHasher(int algo) : algo(algo) {}
+
+	inline void update(const void *data, size_t len)
+	{
+		if(algo == CHECKSUM_CRC32C) crc.update(data, len);
+		else xxh.update(data, len);
+	}
+
+	std::string hex() const
+	{
+		char buf[17];
+		if(algo == CHECKSUM_CRC32C) snprintf(buf, sizeof(buf), "%08x", crc.digest());
+		else snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)xxh.digest());
+		return buf;
+	}
+};
+
+using ChecksumManifest = std::unordered_map<std::string, std::pair<int, std::string>>;
+
+static bool parseChecksums(const std::string &data, ChecksumManifest &manifest, std::string &err)
+{
+	std::istringstream lines(data);
+	std::string line, path, algo, digest;
+	while(std::getline(lines, line)) {
+		if(line.empty()) continue;
+		std::istringstream fields(line);
+		if(!std::getline(fields, path, '\t') || !std::getline(fields, algo, '\t') ||
+		   !std::getline(fields, digest) || checksumAlgo(algo) == CHECKSUM_NONE)
+		{
+			err = "invalid checksum record: " + line;
+			return false;
+		}
+		manifest[manifestUnescape(path)] = {checksumAlgo(algo), digest};
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////// Writing ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Hashes the data of each regular file entry as it is written.
+class ChecksumWriter : public ArchiveChecksums
+{
+	int algo;
+	// file the manifest is also saved to, if not empty
+	std::string sidecar;
+	std::unique_ptr<EntryHasher> current;
+	std::string currentPath;
+	std::string manifest;
+	// set once the manifest was taken, until the archive is reset
+	bool finished;
+
+	void finishEntry()
+	{
+		if(!current) return;
+		manifest += manifestEscape(currentPath) + '\t' + checksumName(algo) + '\t' +
+			    current->hex() + '\n';
+		current.reset();
+	}
+
+public:
+	ChecksumWriter(int algo, const std::string &sidecar)
+		: algo(algo), sidecar(sidecar), finished(false)
+	{}
+
+	void beginEntry(archive_entry *entry) override
+	{
+		finishEntry();
+		const char *path = archive_entry_pathname(entry);
+		if(archive_entry_filetype(entry) != AE_IFREG || !path ||
+		   strcmp(path, CHECKSUM_MEMBER) == 0)
+		{
+			return;
+		}
+		current.reset(new EntryHasher(algo));
+		currentPath = path;
+	}
+	void update(const void *data, size_t len) override
+	{
+		if(current) current->update(data, len);
+	}
+	void restart() override
+	{
+		current.reset();
+		manifest.clear();
+		finished = false;
+	}
+
+	// the manifest, including the last entry
+	const std::string &finish()
+	{
+		finishEntry();
+		finished = true;
+		return manifest;
+	}
+	inline bool isFinished() const { return finished; }
+	inline const std::string &getSidecar() const { return sidecar; }
+};
+
+// Ends a writer with checksums: writes the manifest member, and the sidecar file if requested.
+// Must happen before closing.
+static bool writeChecksumManifest(VarArchive *ar, ArchiveStatus &status)
+{
+	ChecksumWriter *sums = static_cast<ChecksumWriter *>(ar->getChecksums());
+	// closing twice must not write it again
+	if(!sums || sums->isFinished()) return true;
+	const std::string &data	   = sums->finish();
+	const std::string &sidecar = sums->getSidecar();
+	// the manifest member itself is not hashed
+	if(!writeArchiveMember(ar, CHECKSUM_MEMBER, data, status)) return false;
+	if(sidecar.empty()) return true;
+	std::ofstream out(sidecar, std::ios::trunc);
+	if(!out.write(data.data(), data.size()).flush()) {
+		status.fail("failed to write checksums to '" + sidecar + "'", ARCHIVE_FATAL);
+		return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Verifying ///////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Checks the data read by extract against the checksums of the archive. With a sidecar file, the
+// expected checksums are known upfront and each entry is checked as soon as its data was read;
+// otherwise they come from the manifest member at the end of the archive.
+class ChecksumVerifier
+{
+	// algorithm used without a sidecar, CHECKSUM_NONE if not verifying at all
+	int algo;
+	bool hasSidecar;
+	bool sawManifest;
+	ChecksumManifest expected;
+	// entries already read, when the expected checksums come at the end
+	ChecksumManifest computed;
+	std::unique_ptr<EntryHasher> current;
+	std::string currentPath;
+	int currentAlgo;
+	la_int64_t currentSize;
+	la_int64_t pos;
+
+	void compare(const std::string &path, const std::pair<int, std::string> &sum,
+		     ArchiveStatus &status)
+	{
+		auto exp = expected.find(path);
+		if(exp == expected.end()) {
+			status.fail("extract - no checksum recorded for '" + path + "'", ARCHIVE_WARN);
+		} else if(exp->second != sum) {
+			status.fail("extract - checksum mismatch for '" + path + "'", ARCHIVE_FATAL);
+		}
+	}
+
+public:
+	ChecksumVerifier(int algo) : algo(algo), hasSidecar(false), sawManifest(false) {}
+
+	inline bool enabled() const { return algo != CHECKSUM_NONE || hasSidecar; }
+
+	bool loadSidecar(const std::string &file, std::string &err)
+	{
+		std::ifstream in(file);
+		if(!in) {
+			err = "failed to open checksums '" + file + "'";
+			return false;
+		}
+		std::stringstream data;
+		data << in.rdbuf();
+		hasSidecar = true;
+		return parseChecksums(data.str(), expected, err);
+	}
+
+	inline bool isManifest(archive_entry *e) const
+	{
+		const char *path = archive_entry_pathname(e);
+		return enabled() && path && strcmp(path, CHECKSUM_MEMBER) == 0;
+	}
+
+	// reads the manifest member and checks the entries read before it
+	int readManifest(archive *a, ArchiveStatus &status)
+	{
+		std::string data;
+		char buf[16384];
+		la_ssize_t len;
+		while((len = archive_read_data(a, buf, sizeof(buf))) > 0) data.append(buf, len);
+		if(len < 0) {
+			status.fail("extract - reading checksums failed: " + archiveErrStr(a),
+				    ARCHIVE_FATAL);
+			return ARCHIVE_FATAL;
+		}
+		sawManifest = true;
+		if(hasSidecar) return ARCHIVE_OK;
+		std::string err;
+		if(!parseChecksums(data, expected, err)) {
+			status.fail("extract - " + err, ARCHIVE_FATAL);
+			return ARCHIVE_FATAL;
+		}
+		for(auto &sum : computed) compare(sum.first, sum.second, status);
+		computed.clear();
+		return status.aborted ? status.fatalCode : ARCHIVE_OK;
+	}
+
+	// call with the entry before it is renamed
+	void begin(archive_entry *e)
+	{
+		current.reset();
+		if(!enabled() || archive_entry_filetype(e) != AE_IFREG) return;
+		currentPath = archive_entry_pathname(e);
+		currentAlgo = algo;
+		if(hasSidecar) {
+			auto exp = expected.find(currentPath);
+			if(exp != expected.end()) currentAlgo = exp->second.first;
+		}
+		// entries missing from a sidecar are still hashed, to report them at the end
+		if(currentAlgo == CHECKSUM_NONE) currentAlgo = CHECKSUM_XXH64;
+		current.reset(new EntryHasher(currentAlgo));
+		currentSize = archive_entry_size(e);
+		pos	    = 0;
+	}
+	// the entry is not extracted after all
+	inline void cancel() { current.reset(); }
+
+	// hashes a data block, with the holes before it as zeros
+	void update(const void *data, size_t len, la_int64_t offset)
+	{
+		static const char zeros[64 * 1024] = {};
+		if(!current) return;
+		while(pos < offset) {
+			size_t chunk = std::min(offset - pos, (la_int64_t)sizeof(zeros));
+			current->update(zeros, chunk);
+			pos += chunk;
+		}
+		if(len > 0) current->update(data, len);
+		pos = offset + len;
+	}
+
+	// checks the entry at once with a sidecar, otherwise remembers its checksum
+	void end(ArchiveStatus &status)
+	{
+		if(!current) return;
+		// trailing holes
+		update(nullptr, 0, currentSize);
+		if(hasSidecar) compare(currentPath, {currentAlgo, current->hex()}, status);
+		else computed[currentPath] = {currentAlgo, current->hex()};
+		current.reset();
+	}
+
+	// fails the extraction if there was nothing to verify the entries against
+	void finish(ArchiveStatus &status)
+	{
+		if(enabled() && !hasSidecar && !sawManifest) {
+			status.fail("extract - archive has no " CHECKSUM_MEMBER " member to verify",
+				    ARCHIVE_FATAL);
+		}
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// setChecksum(algo, sidecar = '')
+// Makes the writer hash each regular file's data (CHECKSUM_CRC32C or CHECKSUM_XXH64) as it is
+// written, and add the checksums as a final member on close(), also saved to `sidecar` if given.
+// CHECKSUM_NONE turns it off. extract(verify = algo) or extract(checksums = sidecar) checks them.
+Var *feralArchiveSetChecksum(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			     const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	if(!args[1]->is<VarInt>()) {
+		vm.fail(args[1]->getLoc(), "expected checksum algorithm to be of type 'int', found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	if(ar->getMode() != OM_WRITE) {
+		vm.fail(loc, "checksums are computed by archives in write mode, use extract(verify)");
+		return nullptr;
+	}
+	int64_t algo = as<VarInt>(args[1])->get();
+	if(algo != CHECKSUM_NONE && algo != CHECKSUM_CRC32C && algo != CHECKSUM_XXH64) {
+		vm.fail(args[1]->getLoc(), "invalid checksum algorithm: ", algo);
+		return nullptr;
+	}
+	std::string sidecar;
+	if(!assnArgStr(vm, assn_args, "sidecar", sidecar)) return nullptr;
+	ar->setChecksums(algo == CHECKSUM_NONE ? nullptr : new ChecksumWriter(algo, sidecar));
+	return args[0];
+}
@@ -0,0 +1,954 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <map>
+#include <sys/stat.h>
+#include <thread>
+
+#include "ArchiveAdaptive.hpp"
+#include "ArchiveEntry.hpp"
+#include "ArchiveHash.hpp"
+#include "ArchiveIncremental.hpp"
+#include "ArchiveQueue.hpp"
+#include "ArchiveTask.hpp"
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Metadata and (possibly prefetched) contents of a file that is to be added to an archive.
+struct DiskItem
+{
+	EntryPtr entry;
+	// open descriptor of a regular file whose contents were not prefetched
+	int fd;
+	std::vector<char> data;
+	// true if `data` holds the complete contents of the file
+	bool complete;
+	// XXH64 of the contents, if `hashed`
+	uint64_t hash;
+	bool hashed;
+	std::string error;
+
+	DiskItem() : fd(-1), complete(false), hash(0), hashed(false) {}
+	DiskItem(DiskItem &&other)
+		: entry(std::move(other.entry)), fd(other.fd), data(std::move(other.data)),
+		  complete(other.complete), hash(other.hash), hashed(other.hashed),
+		  error(std::move(other.error))
+	{
+		other.fd = -1;
+	}
+	~DiskItem()
+	{
+		if(fd >= 0) close(fd);
+	}
+	DiskItem &operator=(DiskItem &&other)
+	{
+		if(fd >= 0) close(fd);
+		entry	 = std::move(other.entry);
+		fd	 = other.fd;
+		data	 = std::move(other.data);
+		complete = other.complete;
+		hash	 = other.hash;
+		hashed	 = other.hashed;
+		error	 = std::move(other.error);
+		other.fd = -1;
+		return *this;
+	}
+};
+
+// Records the data regions of a file with holes as the entry's sparse map. Formats supporting
+// sparse entries (pax) then store only those regions; the rest is never read from disk. Other
+// formats drop the map when the header is written, see writesSparse().
+static void loadSparseMap(int fd, const struct stat &st, archive_entry *e)
+{
+	if((la_int64_t)st.st_blocks * 512 >= st.st_size) return;
+	off_t data = 0, hole = 0;
+	while(data < st.st_size && (data = lseek(fd, data, SEEK_DATA)) >= 0) {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if(hole < 0 || hole > st.st_size) hole = st.st_size;
+		archive_entry_sparse_add_entry(e, data, hole - data);
+		data = hole;
+	}
+	// no more data up to the end (ENXIO): a file of only holes, or ending in one, needs an empty
+	// region at its end, otherwise an empty map means the whole file is read as data
+	if(data < 0 && errno == ENXIO && hole < st.st_size) {
+		archive_entry_sparse_add_entry(e, st.st_size, 0);
+	}
+	lseek(fd, 0, SEEK_SET);
+}
+
+// Opens a regular file that lstat() found, for reading. The path may have been replaced since:
+// symlinks are not followed, FIFOs do not block, and anything but a regular file, or another file
+// than `expected` if given, is refused. Returns -1 with `err` set on failure.
+static int openDiskFile(const char *path, const struct stat *expected, std::string &err)
+{
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+	if(fd < 0) {
+		err = std::string("failed to open '") + path + "': " + strerror(errno);
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+	   (expected && (st.st_dev != expected->st_dev || st.st_ino != expected->st_ino)))
+	{
+		err = std::string("'") + path + "' was replaced while it was being added";
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// hashes the contents of a regular file without moving its offset
+static bool hashDiskFile(int fd, uint64_t &hash)
+{
+	std::vector<char> buf(1 << 20);
+	XXH64 state;
+	off_t pos = 0;
+	ssize_t len;
+	while((len = pread(fd, buf.data(), buf.size(), pos)) > 0) {
+		state.update(buf.data(), len);
+		pos += len;
+	}
+	hash = state.digest();
+	return len == 0;
+}
+
+// Fills `item` with the metadata of `path` (symlinks are not followed). Regular files up to
+// `prefetch` bytes are read into memory; larger ones are opened with read-ahead requested.
+// With `hash`, the contents of regular files are hashed for deduplication.
+static void loadDiskItem(const std::string &path, size_t prefetch, bool hash, DiskItem &item)
+{
+	struct stat st;
+	if(lstat(path.c_str(), &st) != 0) {
+		item.error = "failed to stat '" + path + "': " + strerror(errno);
+		return;
+	}
+	item.entry.reset(archive_entry_new());
+	archive_entry *e = item.entry.get();
+	archive_entry_copy_pathname(e, path.c_str());
+	archive_entry_copy_sourcepath(e, path.c_str());
+	archive_entry_copy_stat(e, &st);
+
+	if(S_ISLNK(st.st_mode)) {
+		std::string target(st.st_size > 0 ? st.st_size : PATH_MAX, '\0');
+		ssize_t len = readlink(path.c_str(), &target[0], target.size());
+		if(len < 0) {
+			item.error = "failed to read link '" + path + "': " + strerror(errno);
+			return;
+		}
+		target.resize(len);
+		archive_entry_copy_symlink(e, target.c_str());
+		return;
+	}
+	if(!S_ISREG(st.st_mode)) {
+		archive_entry_set_size(e, 0);
+		return;
+	}
+	if(st.st_size == 0) return;
+
+	int fd = openDiskFile(path.c_str(), &st, item.error);
+	if(fd < 0) return;
+	if((size_t)st.st_size > prefetch) {
+		loadSparseMap(fd, st, e);
+#if defined(__linux__)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, std::min((size_t)st.st_size, (size_t)8 << 20),
+			      POSIX_FADV_WILLNEED);
+#endif
+		item.fd	    = fd;
+		item.hashed = hash && hashDiskFile(fd, item.hash);
+		return;
+	}
+	item.data.resize(st.st_size);
+	size_t done = 0;
+	ssize_t len;
+	while(done < item.data.size() &&
+	      (len = read(fd, item.data.data() + done, item.data.size() - done)) > 0)
+	{
+		done += len;
+	}
+	close(fd);
+	// a file that shrank in the meantime is padded by the archive writer
+	item.data.resize(done);
+	item.complete = true;
+	if(hash) {
+		item.hash   = XXH64::hash(item.data.data(), item.data.size());
+		item.hashed = true;
+	}
+}
+
+// true if the archive's format stores the sparse map of entries, and drops their holes
+static bool writesSparse(archive *a)
+{
+	int format = archive_format(a);
+	return format == ARCHIVE_FORMAT_TAR_PAX_INTERCHANGE ||
+	       format == ARCHIVE_FORMAT_TAR_PAX_RESTRICTED;
+}
+
+// Hands a hole of a sparse entry to the writer, which expects the holes in the data it is given
+// but drops them: the zeros are never read from disk, compressed, or counted as entry data.
+// Checksums still cover them, as they do the extracted file.
+static bool writeHole(VarArchive *ar, la_int64_t len, ArchiveStatus &status)
+{
+	static const char zeros[64 * 1024] = {};
+	ArchiveStats &stats = ar->getStats();
+	while(len > 0) {
+		size_t chunk = std::min(len, (la_int64_t)sizeof(zeros));
+		if(timed(stats.archiveNs,
+			 [&] { return archive_write_data(ar->get(), zeros, chunk); }) < 0)
+		{
+			status.fail("failed to write data: " + archiveErrStr(ar->get()), ARCHIVE_FATAL);
+			return false;
+		}
+		if(ar->getChecksums()) ar->getChecksums()->update(zeros, chunk);
+		len -= chunk;
+	}
+	return true;
+}
+
+// Reads only the data regions of the entry's sparse map, for formats that writesSparse().
+static bool writeSparseData(VarArchive *ar, archive_entry *e, int fd, std::vector<char> &buf,
+			    ArchiveStatus &status)
+{
+	ArchiveStats &stats = ar->getStats();
+	la_int64_t pos	    = 0, offset, length;
+	ssize_t len;
+	while(archive_entry_sparse_next(e, &offset, &length) == ARCHIVE_OK) {
+		if(!writeHole(ar, offset - pos, status)) return false;
+		pos = offset;
+		while(length > 0 && (len = timed(stats.diskNs, [&] {
+					     return pread(fd, buf.data(),
+							  std::min((la_int64_t)buf.size(), length), pos);
+				     })) > 0)
+		{
+			if(!writeArchiveData(ar, buf.data(), len, status)) return false;
+			pos += len;
+			length -= len;
+		}
+	}
+	return writeHole(ar, archive_entry_size(e) - pos, status);
+}
+
+// Writes the data of entry `e`. `item` is the item the entry was loaded from, or nullptr if
+// the data must be read again from the entry's source path (deferred hardlinks).
+static bool writeDiskData(VarArchive *ar, archive_entry *e, DiskItem *item, std::vector<char> &buf,
+			  ArchiveStatus &status)
+{
+	ArchiveStats &stats = ar->getStats();
+	if(archive_entry_filetype(e) != AE_IFREG || archive_entry_size(e) <= 0) return true;
+	if(item && item->complete) {
+		return writeArchiveData(ar, item->data.data(), item->data.size(), status);
+	}
+	int fd = item ? item->fd : -1;
+	std::string err;
+	if(fd < 0) fd = openDiskFile(archive_entry_sourcepath(e), archive_entry_stat(e), err);
+	if(item) item->fd = -1;
+	// the header is already written, the archive writer pads the missing data with zeros
+	if(fd < 0) {
+		status.fail(err, ARCHIVE_WARN);
+		return true;
+	}
+	if(archive_entry_sparse_reset(e) > 0) {
+		bool ok = writeSparseData(ar, e, fd, buf, status);
+		close(fd);
+		return ok;
+	}
+	la_int64_t remaining = archive_entry_size(e);
+	ssize_t len;
+	while(remaining > 0 &&
+	      (len = timed(stats.diskNs, [&] { return read(fd, buf.data(), buf.size()); })) > 0)
+	{
+		if(!writeArchiveData(ar, buf.data(), len, status)) {
+			close(fd);
+			return false;
+		}
+		remaining -= len;
+	}
+	close(fd);
+	return true;
+}
+
+static bool writeDiskHeaderAndData(VarArchive *ar, archive_entry *e, DiskItem *item,
+				   std::vector<char> &buf, ArchiveStatus &status)
+{
+	archive *a = ar->get();
+	// other formats store the holes as data, read from the file like the rest of it
+	if(archive_entry_sparse_count(e) > 0 && !writesSparse(a)) archive_entry_sparse_clear(e);
+	if(ar->isAdaptive()) {
+		bool prefetched = item && item->complete;
+		chooseZipCompression(a, e, prefetched ? item->data.data() : nullptr,
+				     prefetched ? item->data.size() : 0, item ? item->fd : -1);
+	}
+	int code = writeArchiveHeader(ar, e);
+	if(code < ARCHIVE_OK) {
+		status.fail(std::string("failed to write header for '") +
+			    archive_entry_pathname(e) + "': " + archiveErrStr(a),
+			    code);
+		if(code < ARCHIVE_WARN) return false;
+	}
+	return writeDiskData(ar, e, item, buf, status);
+}
+
+// true if the file at `path` has exactly the contents of `item`
+static bool sameDiskContents(const std::string &path, DiskItem &item, la_int64_t size)
+{
+	std::string err;
+	int fd = openDiskFile(path.c_str(), nullptr, err);
+	if(fd < 0) return false;
+	std::vector<char> ours(1 << 16), theirs(1 << 16);
+	la_int64_t pos = 0;
+	bool same      = true;
+	while(same && pos < size) {
+		size_t chunk = std::min((la_int64_t)ours.size(), size - pos);
+		const char *mine;
+		if(item.complete) {
+			mine = item.data.data() + pos;
+		} else {
+			if(pread(item.fd, ours.data(), chunk, pos) != (ssize_t)chunk) same = false;
+			mine = ours.data();
+		}
+		same = same && pread(fd, theirs.data(), chunk, pos) == (ssize_t)chunk &&
+		       memcmp(mine, theirs.data(), chunk) == 0;
+		pos += chunk;
+	}
+	// the candidate must not have grown either
+	struct stat st;
+	same = same && fstat(fd, &st) == 0 && st.st_size == size;
+	close(fd);
+	return same;
+}
+
+// Turns the item's entry into a hardlink to an identical regular file stored earlier.
+// Candidates are compared byte by byte, so hash collisions never link different files.
+static bool linkDuplicate(VarArchive *ar, DiskItem &item)
+{
+	archive_entry *e = item.entry.get();
+	la_int64_t size	 = archive_entry_size(e);
+	if(!item.hashed || archive_entry_filetype(e) != AE_IFREG || size <= 0 ||
+	   archive_entry_nlink(e) > 1)
+	{
+		return false;
+	}
+	auto range = ar->getContents().equal_range(item.hash);
+	for(auto it = range.first; it != range.second; ++it) {
+		if(it->second.size != size || !sameDiskContents(it->second.sourcepath, item, size)) {
+			continue;
+		}
+		archive_entry_copy_hardlink(e, it->second.pathname.c_str());
+		archive_entry_set_size(e, 0);
+		return true;
+	}
+	return false;
+}
+
+static void recordContents(VarArchive *ar, archive_entry *e, DiskItem &item)
+{
+	if(!item.hashed || archive_entry_hardlink(e) || archive_entry_size(e) <= 0) return;
+	ar->getContents().insert(
+	{item.hash, {archive_entry_size(e), archive_entry_pathname(e), archive_entry_sourcepath(e)}});
+}
+
+// Writes the item through the archive's hardlink resolver, so that the contents of files with
+// multiple links are stored only once.
+static bool writeDiskItem(VarArchive *ar, DiskItem &item, std::vector<char> &buf,
+			  ArchiveStatus &status)
+{
+	// files that vanished or cannot be read are skipped, as by bsdtar
+	if(!item.error.empty()) {
+		status.fail(item.error, ARCHIVE_WARN);
+		return true;
+	}
+	if(linkDuplicate(ar, item)) {
+		EntryPtr e = std::move(item.entry);
+		return writeDiskHeaderAndData(ar, e.get(), nullptr, buf, status);
+	}
+	archive_entry *orig  = item.entry.release();
+	archive_entry *e     = orig;
+	archive_entry *spare = nullptr;
+	archive_entry_linkify(ar->getLinkResolver(), &e, &spare);
+	// the resolver keeps ownership of deferred entries and hands them back later
+	bool ok = true;
+	if(e) {
+		ok = writeDiskHeaderAndData(ar, e, e == orig ? &item : nullptr, buf, status);
+		if(ok && e == orig) recordContents(ar, e, item);
+		archive_entry_free(e);
+	}
+	if(spare) {
+		if(ok) ok = writeDiskHeaderAndData(ar, spare, nullptr, buf, status);
+		archive_entry_free(spare);
+	}
+	if(ok && !ar->getStats().report()) {
+		status.fail("stopped by progress callback", ARCHIVE_FATAL);
+		ok = false;
+	}
+	return ok;
+}
+
+// Writes the entries still held back by the hardlink resolver; must happen before closing.
+static bool flushDiskLinks(VarArchive *ar, ArchiveStatus &status)
+{
+	if(!ar->hasLinkResolver()) return true;
+	std::vector<char> buf(1 << 20);
+	archive_entry *e, *spare;
+	bool ok = true;
+	for(;;) {
+		e     = nullptr;
+		spare = nullptr;
+		archive_entry_linkify(ar->getLinkResolver(), &e, &spare);
+		if(!e) break;
+		if(ok) ok = writeDiskHeaderAndData(ar, e, nullptr, buf, status);
+		archive_entry_free(e);
+	}
+	return ok;
+}
+
+// Calls emit() for `root` and, if it is a directory, for everything below it (depth first,
+// sorted by name, without following symlinks). Stops when emit() returns false.
+static bool walkDiskTree(const std::string &root, ArchiveStatus &status,
+			 const std::function<bool(std::string &&)> &emit)
+{
+	struct stat st;
+	if(!emit(std::string(root))) return false;
+	if(lstat(root.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return true;
+
+	DIR *dir = opendir(root.c_str());
+	// the directory itself was added, only its contents are skipped
+	if(!dir) {
+		status.fail("failed to open directory '" + root + "': " + strerror(errno),
+			    ARCHIVE_WARN);
+		return true;
+	}
+	std::vector<std::pair<std::string, unsigned char>> children;
+	struct dirent *d;
+	while((d = readdir(dir))) {
+		if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+		children.emplace_back(d->d_name, d->d_type);
+	}
+	closedir(dir);
+	std::sort(children.begin(), children.end());
+
+	std::string prefix = root.back() == '/' ? root : root + "/";
+	for(auto &child : children) {
+		std::string path = prefix + child.first;
+		if(child.second == DT_DIR || child.second == DT_UNKNOWN) {
+			if(!walkDiskTree(path, status, emit)) return false;
+		} else if(!emit(std::move(path))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Reorders items loaded by the prefetch workers back into the order the paths were produced in,
+// and limits how far ahead of the writer the producer may run.
+class PrefetchWindow
+{
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::map<size_t, DiskItem> ready;
+	size_t consumed;
+	size_t total;
+	size_t window;
+	bool aborted;
+
+public:
+	PrefetchWindow(size_t window)
+		: consumed(0), total(SIZE_MAX), window(window), aborted(false)
+	{}
+
+	// blocks the producer until item `index` fits in the window
+	bool waitForRoom(size_t index)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [&] { return aborted || index < consumed + window; });
+		return !aborted;
+	}
+	void put(size_t index, DiskItem &&item)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if(aborted) return;
+		ready.emplace(index, std::move(item));
+		cv.notify_all();
+	}
+	// returns the next item in order, false once all `total` items were taken or on abort
+	bool take(DiskItem &item)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [&] {
+			return aborted || consumed == total || ready.count(consumed) > 0;
+		});
+		if(aborted || consumed == total) return false;
+		auto it = ready.find(consumed);
+		item	= std::move(it->second);
+		ready.erase(it);
+		++consumed;
+		cv.notify_all();
+		return true;
+	}
+	void finish(size_t count)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		total = count;
+		cv.notify_all();
+	}
+	void abort()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		aborted = true;
+		ready.clear();
+		cv.notify_all();
+	}
+};
+
+struct AddOptions
+{
+	// threads loading metadata and contents ahead of the writer, 0 does everything serially
+	size_t threads;
+	// regular files up to this size are read into memory by the prefetch threads
+	size_t prefetch;
+	// store regular files identical to one stored before as hardlinks to it (tar formats)
+	bool dedup;
+	// set for incremental runs: only entries changed since the previous manifest are written
+	std::unique_ptr<IncrementalState> incremental;
+	// where the incremental run stores its manifest, if anywhere
+	std::string manifest;
+
+	AddOptions() : threads(4), prefetch(1 << 20), dedup(false) {}
+
+	inline bool hashContents() const { return dedup || (incremental && incremental->hash); }
+};
+
+// writes the item unless the incremental run finds it unchanged
+static bool addDiskItem(VarArchive *ar, const AddOptions &opts, DiskItem &item,
+			std::vector<char> &buf, ArchiveStatus &status)
+{
+	if(opts.incremental && item.error.empty() &&
+	   !opts.incremental->keep(item.entry.get(), item.hashed, item.hash))
+	{
+		return true;
+	}
+	return writeDiskItem(ar, item, buf, status);
+}
+
+using PathProducer =
+std::function<bool(ArchiveStatus &status, const std::function<bool(std::string &&)> &emit)>;
+
+// Adds the paths produced by `produce` to the archive in production order. Loading happens on
+// the prefetch threads; the archive itself is only written from the calling thread.
+static bool addDiskPaths(VarArchive *ar, const AddOptions &opts, const PathProducer &produce,
+			 ArchiveStatus &status)
+{
+	std::vector<char> buf(1 << 20);
+	ArchiveStats &stats = ar->getStats();
+	if(opts.threads == 0) {
+		produce(status, [&](std::string &&path) {
+			// also stops on cancellation of an async add
+			if(status.aborted) return false;
+			DiskItem item;
+			timed(stats.diskNs, [&] { loadDiskItem(path, 0, opts.hashContents(), item); });
+			return addDiskItem(ar, opts, item, buf, status);
+		});
+		return !status.aborted;
+	}
+
+	PrefetchWindow window(opts.threads * 16);
+	BoundedQueue<std::pair<size_t, std::string>> paths(opts.threads * 16);
+	std::thread producer([&] {
+		size_t index = 0;
+		produce(status, [&](std::string &&path) {
+			if(!window.waitForRoom(index)) return false;
+			return paths.push({index++, std::move(path)});
+		});
+		paths.close();
+		window.finish(index);
+	});
+	std::vector<std::thread> loaders;
+	for(size_t i = 0; i < opts.threads; ++i) {
+		loaders.emplace_back([&] {
+			std::pair<size_t, std::string> path;
+			while(paths.pop(path)) {
+				DiskItem item;
+				timed(stats.diskNs, [&] {
+					loadDiskItem(path.second, opts.prefetch, opts.hashContents(),
+						     item);
+				});
+				window.put(path.first, std::move(item));
+			}
+		});
+	}
+
+	DiskItem item;
+	while(!status.aborted && window.take(item)) {
+		if(!addDiskItem(ar, opts, item, buf, status)) break;
+	}
+	// also wakes up the producer if it stopped on a walk error
+	window.abort();
+	paths.close();
+	producer.join();
+	for(auto &loader : loaders) loader.join();
+	return !status.aborted;
+}
+
+static bool parseAddOptions(Interpreter &vm, ModuleLoc loc, VarArchive *ar,
+			    const StringMap<AssnArgData> &assn_args, AddOptions &opts)
+{
+	int64_t threads	 = opts.threads;
+	int64_t prefetch = opts.prefetch;
+	if(!assnArgInt(vm, assn_args, "threads", threads) ||
+	   !assnArgInt(vm, assn_args, "prefetch", prefetch) ||
+	   !assnArgBool(vm, assn_args, "dedup", opts.dedup))
+	{
+		return false;
+	}
+	// other formats either lack hardlinks or store their data again
+	if(opts.dedup && (archive_format(ar->get()) & ARCHIVE_FORMAT_BASE_MASK) != ARCHIVE_FORMAT_TAR)
+	{
+		vm.fail(loc, "content deduplication requires a tar format");
+		return false;
+	}
+	if(threads < 0 || prefetch < 0) {
+		vm.fail(threads < 0 ? findAssnArg(assn_args, "threads")->getLoc()
+				    : findAssnArg(assn_args, "prefetch")->getLoc(),
+			"thread count and prefetch size cannot be negative");
+		return false;
+	}
+	opts.threads  = threads;
+	opts.prefetch = prefetch;
+	return true;
+}
+
+// since = previous manifest, manifest = where to store the new one, hash = compare contents
+static bool parseIncrementalOptions(Interpreter &vm, ModuleLoc loc,
+				    const StringMap<AssnArgData> &assn_args, AddOptions &opts)
+{
+	std::string since;
+	bool hash = false;
+	if(!assnArgStr(vm, assn_args, "since", since) ||
+	   !assnArgStr(vm, assn_args, "manifest", opts.manifest) ||
+	   !assnArgBool(vm, assn_args, "hash", hash))
+	{
+		return false;
+	}
+	if(since.empty() && opts.manifest.empty()) return true;
+	opts.incremental.reset(new IncrementalState);
+	opts.incremental->hash = hash;
+	std::string err;
+	if(!since.empty() && !loadManifest(since, opts.incremental->getPrevious(), err)) {
+		vm.fail(loc, err);
+		return false;
+	}
+	return true;
+}
+
+// ends an incremental run with the deleted paths member and the new manifest
+static bool finishIncremental(VarArchive *ar, const AddOptions &opts, ArchiveStatus &status)
+{
+	if(!opts.incremental) return true;
+	if(!writeIncrementalDeleted(ar, *opts.incremental, status)) return false;
+	std::string err;
+	if(!opts.manifest.empty() && !saveManifest(opts.manifest, opts.incremental->getCurrent(), err))
+	{
+		status.fail(err, ARCHIVE_FATAL);
+		return false;
+	}
+	return true;
+}
+
+// Loads the item to write for a map of entry fields (see fillEntry): the file at `sourcepath`
+// with its metadata, or else a regular file holding the `data` string. The map's fields override
+// the ones taken from the file.
+static bool loadFieldsItem(Interpreter &vm, VarMap *fields, DiskItem &item)
+{
+	auto source = fields->get().find("sourcepath");
+	auto data   = fields->get().find("data");
+	if(source != fields->get().end() && source->second->is<VarStr>()) {
+		loadDiskItem(as<VarStr>(source->second)->get(), 0, false, item);
+		if(!item.error.empty()) {
+			vm.fail(source->second->getLoc(), item.error);
+			return false;
+		}
+	} else {
+		item.entry.reset(archive_entry_new());
+		archive_entry_set_filetype(item.entry.get(), AE_IFREG);
+		archive_entry_set_perm(item.entry.get(), 0644);
+		archive_entry_set_mtime(item.entry.get(), time(nullptr), 0);
+		archive_entry_set_size(item.entry.get(), 0);
+	}
+	if(data != fields->get().end()) {
+		if(!data->second->is<VarStr>()) {
+			vm.fail(data->second->getLoc(), "expected entry data to be of type 'str', found: ",
+				vm.getTypeName(data->second));
+			return false;
+		}
+		const std::string &str = as<VarStr>(data->second)->get();
+		if(item.fd >= 0) close(item.fd);
+		item.fd = -1;
+		item.data.assign(str.begin(), str.end());
+		item.complete = true;
+		archive_entry_set_size(item.entry.get(), str.size());
+	}
+	return fillEntry(vm, fields, item.entry.get(), "data");
+}
+
+static Var *reportAddStatus(Interpreter &vm, ModuleLoc loc, Span<Var *> args, bool ok,
+			    ArchiveStatus &status)
+{
+	// warnings are reported, but the archive holds everything else
+	for(auto &err : status.errors) vm.fail(loc, err);
+	return ok ? args[0] : nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// addFile(path, dedup = false)
+// dedup = true stores regular files identical to one added before as hardlinks to it
+Var *feralArchiveAddFile(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			 const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected a file name to write in archive");
+		return nullptr;
+	}
+	VarArchive *ar = as<VarArchive>(args[0]);
+	AddOptions opts;
+	if(!parseAddOptions(vm, loc, ar, assn_args, opts)) return nullptr;
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	std::vector<char> buf(1 << 20);
+	DiskItem item;
+	timed(ar->getStats().diskNs,
+	      [&] { loadDiskItem(as<VarStr>(args[1])->get(), 0, opts.dedup, item); });
+	bool ok = writeDiskItem(ar, item, buf, status);
+	return reportAddStatus(vm, loc, args, ok, status);
+}
+
+// writeFile(path, entry)
+// Writes the file at path with its data streamed natively, using entry for the header: nil for
+// the file's own metadata, a map of fields (see fillEntry) overriding them, or an ArchiveEntry.
+// Unlike addFile, the entry is written as given, without hardlink detection or dedup.
+Var *feralArchiveWriteFile(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			   const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected a file name to write in archive, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	if(!args[2]->is<VarNil>() && !args[2]->is<VarMap>() && !args[2]->is<VarArchiveEntry>()) {
+		vm.fail(args[2]->getLoc(), "expected nil, a map, or an archive entry for header, found: ",
+			vm.getTypeName(args[2]));
+		return nullptr;
+	}
+	VarArchive *ar		= as<VarArchive>(args[0]);
+	const std::string &path = as<VarStr>(args[1])->get();
+	DiskItem item;
+	timed(ar->getStats().diskNs, [&] { loadDiskItem(path, 0, false, item); });
+	if(!item.error.empty()) {
+		vm.fail(loc, item.error);
+		return nullptr;
+	}
+	if(args[2]->is<VarMap>() && !fillEntry(vm, as<VarMap>(args[2]), item.entry.get(), nullptr)) {
+		return nullptr;
+	}
+	if(args[2]->is<VarArchiveEntry>()) {
+		item.entry.reset(archive_entry_clone(as<VarArchiveEntry>(args[2])->get()));
+		archive_entry_copy_sourcepath(item.entry.get(), path.c_str());
+	}
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	std::vector<char> buf(1 << 20);
+	bool ok = writeDiskHeaderAndData(ar, item.entry.get(), &item, buf, status);
+	if(ok && !ar->getStats().report()) {
+		status.fail("stopped by progress callback", ARCHIVE_FATAL);
+		ok = false;
+	}
+	return reportAddStatus(vm, loc, args, ok, status);
+}
+
+// writeEntries(vec)
+// Writes an entry for each map of fields in the vector (see fillEntry), with its data taken from
+// the file at `sourcepath` or from the `data` string; without either, only the header is written.
+Var *feralArchiveWriteEntries(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarVec>()) {
+		vm.fail(args[1]->getLoc(), "expected a vector of entry maps to write, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	VarArchive *ar = as<VarArchive>(args[0]);
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	std::vector<char> buf(1 << 20);
+	bool ok = true;
+	for(auto &fields : as<VarVec>(args[1])->get()) {
+		if(!fields->is<VarMap>()) {
+			vm.fail(fields->getLoc(), "expected a map of entry fields, found: ",
+				vm.getTypeName(fields));
+			return nullptr;
+		}
+		DiskItem item;
+		if(!loadFieldsItem(vm, as<VarMap>(fields), item)) return nullptr;
+		ok = writeDiskHeaderAndData(ar, item.entry.get(), &item, buf, status);
+		if(ok && !ar->getStats().report()) {
+			status.fail("stopped by progress callback", ARCHIVE_FATAL);
+			ok = false;
+		}
+		if(!ok) break;
+	}
+	return reportAddStatus(vm, loc, args, ok, status);
+}
+
+// writeDataFromFd(fd)
+// Writes the rest of the open file descriptor as the current entry's data, in large blocks.
+Var *feralArchiveWriteDataFromFd(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+				 const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarInt>()) {
+		vm.fail(args[1]->getLoc(), "expected a file descriptor to read data from, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	VarArchive *ar	    = as<VarArchive>(args[0]);
+	ArchiveStats &stats = ar->getStats();
+	int fd		    = as<VarInt>(args[1])->get();
+#if defined(__linux__)
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	std::vector<char> buf(1 << 20);
+	ssize_t len;
+	bool ok = true;
+	while(ok && (len = timed(stats.diskNs, [&] { return read(fd, buf.data(), buf.size()); })) > 0)
+	{
+		ok = writeArchiveData(ar, buf.data(), len, status);
+		if(ok && !stats.report()) {
+			status.fail("stopped by progress callback", ARCHIVE_FATAL);
+			ok = false;
+		}
+	}
+	if(ok && len < 0) {
+		status.fail(std::string("failed to read from file descriptor: ") + strerror(errno),
+			    ARCHIVE_FATAL);
+		ok = false;
+	}
+	return reportAddStatus(vm, loc, args, ok, status);
+}
+
+// addTree(path, threads = 4, prefetch = 1MiB, dedup = false, since = '', manifest = '',
+//	   hash = false)
+// Recursively adds path with its file types, symlinks, and hardlinks preserved.
+// With since and/or manifest, only what changed since the `since` manifest is added, followed by
+// a member listing the deleted paths, and the new state is saved to `manifest`.
+Var *feralArchiveAddTree(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			 const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected a directory path to write in archive, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	VarArchive *ar = as<VarArchive>(args[0]);
+	AddOptions opts;
+	if(!parseAddOptions(vm, loc, ar, assn_args, opts) ||
+	   !parseIncrementalOptions(vm, loc, assn_args, opts))
+	{
+		return nullptr;
+	}
+	std::string root = as<VarStr>(args[1])->get();
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	bool ok = addDiskPaths(
+	ar, opts,
+	[&](ArchiveStatus &status, const std::function<bool(std::string &&)> &emit) {
+		return walkDiskTree(root, status, emit);
+	},
+	status);
+	if(ok) ok = finishIncremental(ar, opts, status);
+	return reportAddStatus(vm, loc, args, ok, status);
+}
+
+// addTreeAsync(path, ...) -> ArchiveTask
+// Same arguments as addTree(), which runs on a worker thread; the task's wait() returns the code.
+// The progress callback is not called, use the task's progress() instead.
+Var *feralArchiveAddTreeAsync(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected a directory path to write in archive, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	VarArchive *ar = as<VarArchive>(args[0]);
+	std::shared_ptr<AddOptions> opts = std::make_shared<AddOptions>();
+	if(!parseAddOptions(vm, loc, ar, assn_args, *opts) ||
+	   !parseIncrementalOptions(vm, loc, assn_args, *opts))
+	{
+		return nullptr;
+	}
+	std::string root = as<VarStr>(args[1])->get();
+	return startArchiveTask(vm, loc, ar, [ar, opts, root](ArchiveStatus &status) {
+		bool ok = addDiskPaths(
+		ar, *opts,
+		[&](ArchiveStatus &status, const std::function<bool(std::string &&)> &emit) {
+			return walkDiskTree(root, status, emit);
+		},
+		status);
+		if(ok) ok = finishIncremental(ar, *opts, status);
+		return ok ? ARCHIVE_OK : ARCHIVE_FATAL;
+	});
+}
+
+// addFiles(vec, threads = 4, prefetch = 1MiB, dedup = false, since = '', manifest = '',
+//	    hash = false)
+// Adds each of the paths in the vector; directories are added without their contents.
+Var *feralArchiveAddFiles(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarVec>()) {
+		vm.fail(args[1]->getLoc(), "expected a vector of file names to write in archive, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	std::vector<std::string> files;
+	for(auto &file : as<VarVec>(args[1])->get()) {
+		if(!file->is<VarStr>()) {
+			vm.fail(file->getLoc(), "expected file name to be of type 'str', found: ",
+				vm.getTypeName(file));
+			return nullptr;
+		}
+		files.push_back(as<VarStr>(file)->get());
+	}
+	VarArchive *ar = as<VarArchive>(args[0]);
+	AddOptions opts;
+	if(!parseAddOptions(vm, loc, ar, assn_args, opts) ||
+	   !parseIncrementalOptions(vm, loc, assn_args, opts))
+	{
+		return nullptr;
+	}
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	bool ok = addDiskPaths(
+	ar, opts,
+	[&](ArchiveStatus &status, const std::function<bool(std::string &&)> &emit) {
+		for(auto &file : files) {
+			if(!emit(std::string(file))) return false;
+		}
+		return true;
+	},
+	status);
+	if(ok) ok = finishIncremental(ar, opts, status);
+	return reportAddStatus(vm, loc, args, ok, status);
+}
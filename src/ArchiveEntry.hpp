@@ -4,6 +4,60 @@
 
 #include "ArchiveType.hpp"
 
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Sets the fields of `e` named by the keys of `fields`, in one call:
+// pathname, sourcepath, symlink, hardlink, uname, gname - str
+// size, filetype, perm, uid, gid, mtime - int
+// `extra` is a key the caller handles itself, or nullptr.
+static bool fillEntry(Interpreter &vm, VarMap *fields, archive_entry *e, const char *extra)
+{
+	for(auto &field : fields->get()) {
+		const std::string &key = field.first;
+		Var *v		       = field.second;
+		if(extra && key == extra) continue;
+		if(key == "pathname" || key == "sourcepath" || key == "symlink" ||
+		   key == "hardlink" || key == "uname" || key == "gname")
+		{
+			if(!v->is<VarStr>()) {
+				vm.fail(v->getLoc(), "expected entry field '", key,
+					"' to be of type 'str', found: ", vm.getTypeName(v));
+				return false;
+			}
+			const char *str = as<VarStr>(v)->get().c_str();
+			if(key == "pathname") archive_entry_copy_pathname(e, str);
+			else if(key == "sourcepath") archive_entry_copy_sourcepath(e, str);
+			else if(key == "symlink") archive_entry_copy_symlink(e, str);
+			else if(key == "hardlink") archive_entry_copy_hardlink(e, str);
+			else if(key == "uname") archive_entry_copy_uname(e, str);
+			else archive_entry_copy_gname(e, str);
+			continue;
+		}
+		if(key == "size" || key == "filetype" || key == "perm" || key == "uid" ||
+		   key == "gid" || key == "mtime")
+		{
+			if(!v->is<VarInt>()) {
+				vm.fail(v->getLoc(), "expected entry field '", key,
+					"' to be of type 'int', found: ", vm.getTypeName(v));
+				return false;
+			}
+			int64_t val = as<VarInt>(v)->get();
+			if(key == "size") archive_entry_set_size(e, val);
+			else if(key == "filetype") archive_entry_set_filetype(e, val);
+			else if(key == "perm") archive_entry_set_perm(e, val);
+			else if(key == "uid") archive_entry_set_uid(e, val);
+			else if(key == "gid") archive_entry_set_gid(e, val);
+			else archive_entry_set_mtime(e, val, 0);
+			continue;
+		}
+		vm.fail(v->getLoc(), "unknown archive entry field: ", key);
+		return false;
+	}
+	return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////// Functions ////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -73,4 +127,65 @@ Var *feralArchiveEntrySetPerm(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 	}
 	archive_entry_set_perm(as<VarArchiveEntry>(args[0])->get(), as<VarInt>(args[1])->get());
 	return args[0];
-}
\ No newline at end of file
+}
+
+// setAll(map)
+// Sets all the fields in the map (see fillEntry) with one call.
+Var *feralArchiveEntrySetAll(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			     const StringMap<AssnArgData> &assn_args)
+{
+	if(!args[1]->is<VarMap>()) {
+		vm.fail(loc, "expected a map of archive_entry fields, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	if(!fillEntry(vm, as<VarMap>(args[1]), as<VarArchiveEntry>(args[0])->get(), nullptr)) {
+		return nullptr;
+	}
+	return args[0];
+}
+
+Var *feralArchiveEntryGetPathname(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+				  const StringMap<AssnArgData> &assn_args)
+{
+	const char *path = archive_entry_pathname(as<VarArchiveEntry>(args[0])->get());
+	return vm.makeVar<VarStr>(loc, path ? path : "");
+}
+
+Var *feralArchiveEntryGetSize(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	return vm.makeVar<VarInt>(loc, archive_entry_size(as<VarArchiveEntry>(args[0])->get()));
+}
+
+Var *feralArchiveEntryGetFiletype(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+				  const StringMap<AssnArgData> &assn_args)
+{
+	return vm.makeVar<VarInt>(loc, archive_entry_filetype(as<VarArchiveEntry>(args[0])->get()));
+}
+
+Var *feralArchiveEntryGetPerm(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	return vm.makeVar<VarInt>(loc, archive_entry_perm(as<VarArchiveEntry>(args[0])->get()));
+}
+
+Var *feralArchiveEntryGetMtime(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			       const StringMap<AssnArgData> &assn_args)
+{
+	return vm.makeVar<VarInt>(loc, archive_entry_mtime(as<VarArchiveEntry>(args[0])->get()));
+}
+
+Var *feralArchiveEntryGetSymlink(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+				 const StringMap<AssnArgData> &assn_args)
+{
+	const char *link = archive_entry_symlink(as<VarArchiveEntry>(args[0])->get());
+	return vm.makeVar<VarStr>(loc, link ? link : "");
+}
+
+Var *feralArchiveEntryGetHardlink(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+				  const StringMap<AssnArgData> &assn_args)
+{
+	const char *link = archive_entry_hardlink(as<VarArchiveEntry>(args[0])->get());
+	return vm.makeVar<VarStr>(loc, link ? link : "");
+}
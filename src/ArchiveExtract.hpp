@@ -0,0 +1,1034 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <queue>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "ArchiveChecksum.hpp"
+#include "ArchiveIncremental.hpp"
+#include "ArchiveList.hpp"
+#include "ArchiveQueue.hpp"
+#include "ArchiveTask.hpp"
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct ExtractOptions
+{
+	int flags;
+	// number of disk writer threads, 0 extracts serially on the calling thread
+	size_t threads;
+	// max bytes of decompressed data in flight between the reader and the disk writers
+	size_t queueSize;
+	// archive_match patterns; paths are matched literally
+	std::vector<std::string> include;
+	std::vector<std::string> exclude;
+	std::vector<std::string> paths;
+	// leading path components removed from, and directory prepended to extracted paths
+	size_t strip;
+	std::string prefix;
+	// numeric ids only, remembered parent directories, and preallocated regular files
+	bool fast;
+	// remove the paths listed as deleted by incremental archives instead of extracting the list
+	bool incremental;
+	// checksum algorithm of the archive's manifest member, and sidecar file to verify against
+	int verify;
+	std::string checksums;
+	// zip file whose members are decompressed in parallel, with one handle per thread set up by
+	// zipSetup; empty to read through the archive's own handle
+	std::string zipPath;
+	std::vector<ArchiveSetupFn> zipSetup;
+
+	ExtractOptions()
+		: flags(ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_ACL |
+			ARCHIVE_EXTRACT_FFLAGS),
+		  threads(0), queueSize(64 * 1024 * 1024), strip(0), fast(false),
+		  incremental(false), verify(CHECKSUM_NONE)
+	{}
+};
+
+// Selects and renames entries on the reading side of an extraction.
+class ExtractFilter
+{
+	const ExtractOptions &opts;
+	archive *match;
+
+	// false if nothing is left of the path after stripping
+	bool rewrite(std::string &path)
+	{
+		size_t pos = 0;
+		for(size_t i = 0; i < opts.strip; ++i) {
+			pos = path.find('/', pos);
+			if(pos == std::string::npos) return false;
+			while(pos < path.size() && path[pos] == '/') ++pos;
+		}
+		path.erase(0, pos);
+		if(path.empty()) return false;
+		if(!opts.prefix.empty()) {
+			path.insert(0, opts.prefix.back() == '/' ? opts.prefix : opts.prefix + "/");
+		}
+		return true;
+	}
+
+public:
+	ExtractFilter(const ExtractOptions &opts) : opts(opts), match(nullptr)
+	{
+		if(opts.include.empty() && opts.exclude.empty() && opts.paths.empty()) return;
+		match = archive_match_new();
+		for(auto &pattern : opts.include) archive_match_include_pattern(match, pattern.c_str());
+		for(auto &pattern : opts.exclude) archive_match_exclude_pattern(match, pattern.c_str());
+		for(auto &path : opts.paths) {
+			std::string literal;
+			for(char c : path) {
+				if(c == '*' || c == '?' || c == '[' || c == '\\') literal.push_back('\\');
+				literal.push_back(c);
+			}
+			archive_match_include_pattern(match, literal.c_str());
+		}
+	}
+	~ExtractFilter()
+	{
+		if(match) archive_match_free(match);
+	}
+
+	// returns false if the entry must be skipped, otherwise renames it as requested
+	bool apply(archive_entry *entry)
+	{
+		if(match && archive_match_path_excluded(match, entry)) return false;
+		if(opts.strip == 0 && opts.prefix.empty()) return true;
+		std::string path = archive_entry_pathname(entry);
+		if(!rewrite(path)) return false;
+		archive_entry_copy_pathname(entry, path.c_str());
+		const char *hardlink = archive_entry_hardlink(entry);
+		if(hardlink) {
+			std::string target = hardlink;
+			if(!rewrite(target)) return false;
+			archive_entry_copy_hardlink(entry, target.c_str());
+		}
+		return true;
+	}
+
+	// selects and renames the deleted paths of an incremental archive like entries
+	void applyDeleted(std::vector<std::string> &paths)
+	{
+		EntryPtr entry(archive_entry_new());
+		std::vector<std::string> res;
+		for(auto &path : paths) {
+			archive_entry_copy_pathname(entry.get(), path.c_str());
+			if(apply(entry.get())) res.push_back(archive_entry_pathname(entry.get()));
+		}
+		paths.swap(res);
+	}
+
+	void reportUnmatched(ArchiveStatus &status)
+	{
+		if(!match) return;
+		const char *pattern;
+		while(archive_match_path_unmatched_inclusions_next(match, &pattern) == ARCHIVE_OK) {
+			status.fail(std::string("extract - not found in archive: ") + pattern,
+				    ARCHIVE_WARN);
+		}
+	}
+};
+
+// The umask of the process, read once for the natively written files. Linux reports it in /proc;
+// elsewhere it can only be read by setting it. This does not make DiskWriter creation free of the
+// umask race: archive_write_disk_new() sets and restores the umask itself, so an extraction
+// creates all of its writers before starting its threads. Files created meanwhile by other
+// threads of the process, such as those of another async task, may still get a umask of 0.
+static mode_t processUmask()
+{
+	static const mode_t bits = [] {
+#if defined(__linux__)
+		if(FILE *f = fopen("/proc/self/status", "re")) {
+			char line[128];
+			unsigned int mask;
+			bool found = false;
+			while(!found && fgets(line, sizeof(line), f)) {
+				found = sscanf(line, "Umask: %o", &mask) == 1;
+			}
+			fclose(f);
+			if(found) return (mode_t)mask;
+		}
+#endif
+		mode_t old = umask(0);
+		umask(old);
+		return old;
+	}();
+	return bits;
+}
+
+// Writes extracted entries to disk through archive_write_disk. In fast mode, regular files are
+// written natively: created in their parent directory, which is opened (and created) without
+// following symlinks and kept open for the next file in it, preallocated from the entry size,
+// and given only the permission and time metadata that the flags ask for. Flags asking for
+// checks or any other metadata send every entry through archive_write_disk, as do paths whose
+// parents are not plain directories.
+class DiskWriter
+{
+	archive *ext;
+	int flags;
+	bool fast;
+	mode_t umaskBits;
+	// parent directory of the last natively written file, and its path
+	int parentFd;
+	std::string parentDir;
+	// natively written regular file
+	int fd;
+	archive_entry *entry;
+	std::string err;
+
+	bool native(archive_entry *e) const
+	{
+		// checks, hole punching and metadata that only archive_write_disk implements
+		const int checked = ARCHIVE_EXTRACT_SECURE_SYMLINKS | ARCHIVE_EXTRACT_SECURE_NODOTDOT |
+				    ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS |
+				    ARCHIVE_EXTRACT_NO_OVERWRITE | ARCHIVE_EXTRACT_NO_OVERWRITE_NEWER |
+				    ARCHIVE_EXTRACT_NO_AUTODIR | ARCHIVE_EXTRACT_SPARSE | ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_XATTR |
+				    ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_FFLAGS |
+				    ARCHIVE_EXTRACT_MAC_METADATA;
+		return fast && !(flags & checked) && archive_entry_filetype(e) == AE_IFREG &&
+		       !archive_entry_hardlink(e);
+	}
+
+	// Opens `dir` as parentFd one component at a time, creating the missing ones. False if a
+	// component is "..", a symlink or anything else than a directory, or cannot be created.
+	bool openParent(const std::string &dir)
+	{
+		if(parentFd >= 0 && dir == parentDir) return true;
+		forgetParent();
+		const int oflags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+		int dirFd	 = open(!dir.empty() && dir[0] == '/' ? "/" : ".", oflags);
+		size_t pos	 = 0;
+		while(dirFd >= 0 && pos < dir.size()) {
+			size_t end = dir.find('/', pos);
+			if(end == std::string::npos) end = dir.size();
+			std::string name = dir.substr(pos, end - pos);
+			pos		 = end + 1;
+			if(name.empty() || name == ".") continue;
+			int next = -1;
+			if(name != "..") {
+				next = openat(dirFd, name.c_str(), oflags);
+				if(next < 0 && errno == ENOENT &&
+				   (mkdirat(dirFd, name.c_str(), 0755) == 0 || errno == EEXIST))
+				{
+					next = openat(dirFd, name.c_str(), oflags);
+				}
+			}
+			close(dirFd);
+			dirFd = next;
+		}
+		if(dirFd < 0) return false;
+		parentFd  = dirFd;
+		parentDir = dir;
+		return true;
+	}
+
+	int fail(const std::string &msg)
+	{
+		err = msg + ": " + strerror(errno);
+		return ARCHIVE_FAILED;
+	}
+
+	// `name` is the last component of the entry's path, in parentFd
+	int openNative(archive_entry *e, const char *name)
+	{
+		const char *path = archive_entry_pathname(e);
+		const int oflags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW;
+		fd		 = openat(parentFd, name, oflags, 0600);
+		// existing non-directories are replaced, as archive_write_disk does
+		if(fd < 0 && errno == EEXIST && unlinkat(parentFd, name, 0) == 0) {
+			fd = openat(parentFd, name, oflags, 0600);
+		}
+		if(fd < 0) return fail(std::string("failed to create '") + path + "'");
+		la_int64_t size = archive_entry_size(e);
+#if defined(__linux__)
+		// sparse entries keep their holes
+		if(size > 0 && archive_entry_sparse_count(e) == 0) fallocate(fd, 0, 0, size);
+#endif
+		entry = archive_entry_clone(e);
+		return ARCHIVE_OK;
+	}
+
+	int finishNative()
+	{
+		int code	 = ARCHIVE_OK;
+		const char *path = archive_entry_pathname(entry);
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_size < archive_entry_size(entry) &&
+		   ftruncate(fd, archive_entry_size(entry)) != 0)
+		{
+			code = fail(std::string("failed to resize '") + path + "'");
+		}
+		mode_t perm = archive_entry_perm(entry);
+		if(!(flags & ARCHIVE_EXTRACT_PERM)) perm &= ~umaskBits;
+		if(code == ARCHIVE_OK && fchmod(fd, perm) != 0) {
+			code = fail(std::string("failed to set permissions of '") + path + "'");
+		}
+		if(code == ARCHIVE_OK && (flags & ARCHIVE_EXTRACT_TIME)) {
+			struct timespec times[2] = {
+			{archive_entry_atime(entry), archive_entry_atime_nsec(entry)},
+			{archive_entry_mtime(entry), archive_entry_mtime_nsec(entry)},
+			};
+			if(!archive_entry_atime_is_set(entry)) times[0] = times[1];
+			if(futimens(fd, times) != 0) {
+				code = fail(std::string("failed to set times of '") + path + "'");
+			}
+		}
+		if(close(fd) != 0 && code == ARCHIVE_OK) {
+			code = fail(std::string("failed to close '") + path + "'");
+		}
+		fd = -1;
+		archive_entry_free(entry);
+		entry = nullptr;
+		return code;
+	}
+
+public:
+	DiskWriter(const ExtractOptions &opts)
+		: ext(archive_write_disk_new()), flags(opts.flags), fast(opts.fast), parentFd(-1),
+		  fd(-1), entry(nullptr)
+	{
+		archive_write_disk_set_options(ext, flags);
+		// without a lookup, owners are restored from the numeric ids
+		if(!fast) archive_write_disk_set_standard_lookup(ext);
+		umaskBits = processUmask();
+	}
+	~DiskWriter()
+	{
+		if(fd >= 0) close(fd);
+		if(entry) archive_entry_free(entry);
+		forgetParent();
+		archive_write_close(ext);
+		archive_write_free(ext);
+	}
+
+	// closes the remembered parent directory; needed once entries written elsewhere may have
+	// replaced it
+	void forgetParent()
+	{
+		if(parentFd >= 0) close(parentFd);
+		parentFd = -1;
+		parentDir.clear();
+	}
+
+	int writeHeader(archive_entry *e)
+	{
+		err.clear();
+		if(native(e)) {
+			std::string path = archive_entry_pathname(e);
+			size_t pos	 = path.find_last_of('/');
+			std::string dir	 = pos == std::string::npos ? "" : path.substr(0, pos + 1);
+			std::string name = path.substr(dir.size());
+			if(!name.empty() && name != "." && name != ".." && openParent(dir)) {
+				return openNative(e, name.c_str());
+			}
+		}
+		// the entry may replace the remembered directory
+		forgetParent();
+		return archive_write_header(ext, e);
+	}
+	int writeData(const void *buff, size_t size, la_int64_t offset)
+	{
+		if(!entry) return archive_write_data_block(ext, buff, size, offset);
+		size_t done = 0;
+		ssize_t len;
+		while(done < size &&
+		      (len = pwrite(fd, (const char *)buff + done, size - done, offset + done)) > 0)
+		{
+			done += len;
+		}
+		if(done != size) {
+			return fail(std::string("failed to write '") + archive_entry_pathname(entry) +
+				    "'");
+		}
+		return ARCHIVE_OK;
+	}
+	int finishEntry()
+	{
+		if(!entry) return archive_write_finish_entry(ext);
+		return finishNative();
+	}
+
+	std::string errStr() { return err.empty() ? archiveErrStr(ext) : err; }
+};
+
+// Removes what the deleted paths member of an incremental archive lists. The member comes last,
+// and none of the paths it lists occur in the same archive, so pending writes never conflict.
+static int extractIncrementalDeleted(archive *a, const ExtractOptions &opts, ExtractFilter &filter,
+				     ArchiveStatus &status)
+{
+	std::vector<std::string> paths;
+	if(!readIncrementalDeleted(a, paths, status)) return ARCHIVE_FATAL;
+	filter.applyDeleted(paths);
+	applyIncrementalDeleted(paths, opts.flags, status);
+	return ARCHIVE_OK;
+}
+
+// reports progress from the reading thread, stopping the extraction if the callback asks to
+static bool extractProgress(ArchiveStats &stats, ArchiveStatus &status)
+{
+	if(stats.report()) return true;
+	status.fail("extract - stopped by progress callback", ARCHIVE_FATAL);
+	return false;
+}
+
+// progress is reported only if `report`, which must be false on other threads than the calling one
+static int copyData(struct archive *ar, DiskWriter &aw, ChecksumVerifier &verifier,
+		    ArchiveStats &stats, ArchiveStatus &status, bool report)
+{
+	int code;
+	const void *buff;
+	size_t size;
+	la_int64_t offset;
+
+	for(;;) {
+		code = timed(stats.archiveNs,
+			     [&] { return archive_read_data_block(ar, &buff, &size, &offset); });
+		if(code == ARCHIVE_EOF) return ARCHIVE_OK;
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - copyData failed: " + archiveErrStr(ar), code);
+			return code;
+		}
+		verifier.update(buff, size, offset);
+		code = timed(stats.diskNs, [&] { return aw.writeData(buff, size, offset); });
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - copyData failed: " + aw.errStr(), code);
+			return code;
+		}
+		stats.bytes += size;
+		if((report && !extractProgress(stats, status)) || status.aborted) return ARCHIVE_FATAL;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Extraction ///////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// moves past the data of an entry that is not extracted, without decompressing it if the
+// format and source allow seeking
+static int extractSkip(archive *a, ArchiveStats &stats, ArchiveStatus &status)
+{
+	int code = timed(stats.archiveNs, [&] { return archive_read_data_skip(a); });
+	if(code < ARCHIVE_OK) {
+		status.fail("extract - read_data_skip failed: " + archiveErrStr(a), code);
+	}
+	return code;
+}
+
+static int extractSerial(archive *a, const ExtractOptions &opts, ExtractFilter &filter,
+			 ChecksumVerifier &verifier, ArchiveStats &stats, ArchiveStatus &status)
+{
+	DiskWriter ext(opts);
+	archive_entry *entry;
+	int code = ARCHIVE_OK;
+	// also stops on cancellation of an async extract
+	while(!status.aborted) {
+		code = timed(stats.archiveNs, [&] { return archive_read_next_header(a, &entry); });
+		if(code == ARCHIVE_EOF) break;
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - read_next_header failed: " + archiveErrStr(a), code);
+		}
+		if(code < ARCHIVE_WARN) break;
+		if(opts.incremental && isIncrementalDeleted(entry)) {
+			code = extractIncrementalDeleted(a, opts, filter, status);
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		if(verifier.isManifest(entry)) {
+			code = verifier.readManifest(a, status);
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		verifier.begin(entry);
+		if(!filter.apply(entry)) {
+			verifier.cancel();
+			code = extractSkip(a, stats, status);
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		++stats.entries;
+		code = timed(stats.diskNs, [&] { return ext.writeHeader(entry); });
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - writer_header failed: " + ext.errStr(), code);
+			verifier.cancel();
+		} else {
+			if(archive_entry_size(entry) > 0) {
+				code = copyData(a, ext, verifier, stats, status, true);
+			}
+			if(code < ARCHIVE_WARN) break;
+			verifier.end(status);
+		}
+		code = timed(stats.diskNs, [&] { return ext.finishEntry(); });
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - write_finish_entry failed: " + ext.errStr(), code);
+		}
+		if(code < ARCHIVE_WARN) break;
+	}
+	return status.aborted ? status.fatalCode : code;
+}
+
+// A unit of work handed from the decompressing reader to a disk writer. All messages of an
+// entry go to the same writer, in order: one HEADER, any number of DATA, one FINISH. A BARRIER
+// is acknowledged once everything queued before it was written.
+struct ExtractMsg
+{
+	enum Kind
+	{
+		HEADER,
+		DATA,
+		FINISH,
+		BARRIER,
+	} kind;
+	EntryPtr entry;
+	std::vector<char> data;
+	la_int64_t offset;
+
+	ExtractMsg() : kind(FINISH), offset(0) {}
+	ExtractMsg(Kind kind) : kind(kind), offset(0) {}
+};
+
+// Lets the reader wait until every writer has written what was queued so far.
+class ExtractBarrier
+{
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t waiting;
+
+public:
+	ExtractBarrier() : waiting(0) {}
+
+	// call before queueing a BARRIER to each of `writers`
+	void expect(size_t writers)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		waiting = writers;
+	}
+	void arrive()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if(--waiting == 0) cv.notify_one();
+	}
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [&] { return waiting == 0; });
+	}
+};
+
+static void extractWorker(DiskWriter &ext, BoundedQueue<ExtractMsg> &queue,
+			  ExtractBarrier &barrier, ArchiveStats &stats, ArchiveStatus &status)
+{
+	ExtractMsg msg;
+	// set when the current entry's header could not be written, so its data is dropped
+	bool skipData = false;
+	int code;
+	while(queue.pop(msg)) {
+		// acknowledged even when aborted, the reader may be waiting for it
+		if(msg.kind == ExtractMsg::BARRIER) {
+			// the reader writes the entries that change directories after the barrier
+			ext.forgetParent();
+			barrier.arrive();
+			continue;
+		}
+		if(status.aborted) continue; // drain so that the reader never blocks
+		switch(msg.kind) {
+		case ExtractMsg::HEADER: {
+			code = timed(stats.diskNs, [&] { return ext.writeHeader(msg.entry.get()); });
+			skipData = code < ARCHIVE_OK;
+			if(code < ARCHIVE_OK) {
+				status.fail("extract - writer_header failed: " + ext.errStr(),
+					    code);
+			}
+			break;
+		}
+		case ExtractMsg::DATA: {
+			if(skipData) break;
+			code = timed(stats.diskNs, [&] {
+				return ext.writeData(msg.data.data(), msg.data.size(), msg.offset);
+			});
+			if(code < ARCHIVE_OK) {
+				status.fail("extract - copyData failed: " + ext.errStr(), code);
+				skipData = true;
+			}
+			break;
+		}
+		case ExtractMsg::FINISH: {
+			code = timed(stats.diskNs, [&] { return ext.finishEntry(); });
+			if(code < ARCHIVE_OK) {
+				status.fail("extract - write_finish_entry failed: " + ext.errStr(),
+					    code);
+			}
+			break;
+		}
+		case ExtractMsg::BARRIER: break;
+		}
+	}
+}
+
+// FNV-1a, used to pin all entries sharing a path (and hardlinks to their targets) to one writer
+static inline size_t extractPathHash(const char *path)
+{
+	size_t hash = 14695981039346656037ULL;
+	for(; *path; ++path) {
+		hash ^= (unsigned char)*path;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Regular files queued to the writers since they were last drained, and their parent
+// directories. A path that is an ancestor of another in flight must wait for the writers, or
+// whether it ends up a file or a directory would depend on timing.
+class ExtractInFlight
+{
+	std::unordered_set<std::string> files;
+	std::unordered_set<std::string> dirs;
+
+public:
+	bool conflicts(const std::string &path) const
+	{
+		if(dirs.count(path)) return true;
+		for(size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+			if(files.count(path.substr(0, pos))) return true;
+		}
+		return false;
+	}
+	void add(const std::string &path)
+	{
+		files.insert(path);
+		for(size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+			dirs.insert(path.substr(0, pos));
+		}
+	}
+	void clear()
+	{
+		files.clear();
+		dirs.clear();
+	}
+};
+
+// Decompresses on the calling thread and hands headers and data blocks of regular files to
+// `opts.threads` disk writers, each owning a separate archive_write_disk handle. Libarchive
+// copes with concurrent creation of the same parent directories, and directory metadata fixups
+// are applied when the writers are closed - after every worker has finished.
+// Other entries (directories, symlinks, hardlinks, ...) change what later paths resolve to, so
+// the writers are drained first and they are written by the calling thread, in archive order.
+static int extractPipelined(archive *a, const ExtractOptions &opts, ExtractFilter &filter,
+			    ChecksumVerifier &verifier, ArchiveStats &stats, ArchiveStatus &status)
+{
+	size_t threads	 = opts.threads;
+	size_t queueSize = std::max(opts.queueSize / threads, (size_t)1);
+	std::vector<std::unique_ptr<DiskWriter>> exts;
+	std::vector<std::unique_ptr<BoundedQueue<ExtractMsg>>> queues;
+	std::vector<std::thread> workers;
+	ExtractBarrier barrier;
+	ExtractInFlight inFlight;
+	// all writers are created before the workers start, see processUmask()
+	for(size_t i = 0; i < threads; ++i) {
+		exts.emplace_back(new DiskWriter(opts));
+		queues.emplace_back(new BoundedQueue<ExtractMsg>(queueSize));
+	}
+	// the calling thread's own writer, last
+	exts.emplace_back(new DiskWriter(opts));
+	DiskWriter &own = *exts.back();
+	for(size_t i = 0; i < threads; ++i) {
+		workers.emplace_back(extractWorker, std::ref(*exts[i]), std::ref(*queues[i]),
+				     std::ref(barrier), std::ref(stats), std::ref(status));
+	}
+	auto drain = [&]() {
+		barrier.expect(threads);
+		for(auto &queue : queues) queue->push(ExtractMsg(ExtractMsg::BARRIER));
+		barrier.wait();
+		inFlight.clear();
+	};
+
+	archive_entry *entry;
+	const void *buff;
+	size_t size;
+	la_int64_t offset;
+	int code = ARCHIVE_OK;
+	while(!status.aborted) {
+		code = timed(stats.archiveNs, [&] { return archive_read_next_header(a, &entry); });
+		if(code == ARCHIVE_EOF) break;
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - read_next_header failed: " + archiveErrStr(a), code);
+		}
+		if(code < ARCHIVE_WARN) break;
+		if(opts.incremental && isIncrementalDeleted(entry)) {
+			code = extractIncrementalDeleted(a, opts, filter, status);
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		if(verifier.isManifest(entry)) {
+			code = verifier.readManifest(a, status);
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		verifier.begin(entry);
+		if(!filter.apply(entry)) {
+			verifier.cancel();
+			code = extractSkip(a, stats, status);
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		++stats.entries;
+
+		std::string path = archive_entry_pathname(entry);
+		bool regular = archive_entry_filetype(entry) == AE_IFREG && !archive_entry_hardlink(entry);
+		if(!regular || inFlight.conflicts(path)) drain();
+		if(!regular) {
+			code = timed(stats.diskNs, [&] { return own.writeHeader(entry); });
+			if(code < ARCHIVE_OK) {
+				status.fail("extract - writer_header failed: " + own.errStr(), code);
+				verifier.cancel();
+			} else {
+				if(archive_entry_size(entry) > 0) {
+					code = copyData(a, own, verifier, stats, status, true);
+				}
+				if(code < ARCHIVE_WARN) break;
+				verifier.end(status);
+			}
+			code = timed(stats.diskNs, [&] { return own.finishEntry(); });
+			if(code < ARCHIVE_OK) {
+				status.fail("extract - write_finish_entry failed: " + own.errStr(),
+					    code);
+			}
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		inFlight.add(path);
+		BoundedQueue<ExtractMsg> &queue = *queues[extractPathHash(path.c_str()) % threads];
+
+		ExtractMsg header(ExtractMsg::HEADER);
+		header.entry.reset(archive_entry_clone(entry));
+		bool hasData = archive_entry_size(entry) > 0;
+		queue.push(std::move(header));
+		while(hasData && !status.aborted) {
+			code = timed(stats.archiveNs,
+				     [&] { return archive_read_data_block(a, &buff, &size, &offset); });
+			if(code == ARCHIVE_EOF) {
+				code = ARCHIVE_OK;
+				break;
+			}
+			if(code < ARCHIVE_OK) {
+				status.fail("extract - copyData failed: " + archiveErrStr(a), code);
+				if(code < ARCHIVE_WARN) break;
+			}
+			verifier.update(buff, size, offset);
+			ExtractMsg block(ExtractMsg::DATA);
+			block.data.assign((const char *)buff, (const char *)buff + size);
+			block.offset = offset;
+			queue.push(std::move(block), size);
+			stats.bytes += size;
+			if(!extractProgress(stats, status)) {
+				code = ARCHIVE_FATAL;
+				break;
+			}
+		}
+		if(code < ARCHIVE_WARN) break;
+		verifier.end(status);
+		queue.push(ExtractMsg(ExtractMsg::FINISH));
+	}
+
+	for(auto &queue : queues) queue->close();
+	for(auto &worker : workers) worker.join();
+	// closing applies the deferred directory metadata
+	exts.clear();
+	return status.fatalCode != ARCHIVE_OK ? status.fatalCode : code;
+}
+
+// Member name -> thread, balancing the uncompressed bytes per thread: the largest members go
+// first, each to the thread with the least data so far.
+using ZipOwners = std::unordered_map<std::string, size_t>;
+
+static void assignZipMembers(const ListColumns &cols, size_t threads, ZipOwners &owners)
+{
+	std::vector<size_t> order(cols.paths.size());
+	for(size_t i = 0; i < order.size(); ++i) order[i] = i;
+	std::sort(order.begin(), order.end(),
+		  [&](size_t l, size_t r) { return cols.sizes[l] > cols.sizes[r]; });
+	// (bytes, thread), least loaded on top
+	using Load = std::pair<int64_t, size_t>;
+	std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+	for(size_t i = 0; i < threads; ++i) loads.push({0, i});
+	for(size_t i : order) {
+		Load least = loads.top();
+		loads.pop();
+		// duplicate names stay with their first thread, to be extracted in archive order
+		if(!owners.emplace(cols.paths[i], least.second).second) continue;
+		least.first += cols.sizes[i];
+		loads.push(least);
+	}
+}
+
+// Extracts the members of the zip that `owners` assigns to thread `id`, through a handle of its
+// own. Members of other threads are passed over, which the seekable zip reader does by seeking.
+// Every thread sees every member, so the first one reports the unmatched patterns.
+static void extractZipWorker(size_t id, size_t threads, const ExtractOptions &opts,
+			     const ZipOwners &owners, DiskWriter &ext, ArchiveStats &stats,
+			     ArchiveStatus &status)
+{
+	archive *a = archive_read_new();
+	for(auto &step : opts.zipSetup) step(a);
+	if(archive_read_open_filename(a, opts.zipPath.c_str(), 1024 * 1024) != ARCHIVE_OK) {
+		status.fail("extract - failed to open '" + opts.zipPath + "': " + archiveErrStr(a),
+			    ARCHIVE_FATAL);
+		archive_read_free(a);
+		return;
+	}
+	ExtractFilter filter(opts);
+	ChecksumVerifier noVerify(CHECKSUM_NONE);
+	archive_entry *entry;
+	int code = ARCHIVE_OK;
+	while(!status.aborted) {
+		code = timed(stats.archiveNs, [&] { return archive_read_next_header(a, &entry); });
+		if(code == ARCHIVE_EOF) break;
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - read_next_header failed: " + archiveErrStr(a), code);
+		}
+		if(code < ARCHIVE_WARN) break;
+		// hardlinks go with their target, which is extracted before them
+		const char *key = archive_entry_hardlink(entry);
+		if(!key) key = archive_entry_pathname(entry);
+		auto owner    = owners.find(key);
+		size_t thread = owner != owners.end() ? owner->second : extractPathHash(key) % threads;
+		if(!filter.apply(entry) || thread != id) continue;
+		++stats.entries;
+		code = timed(stats.diskNs, [&] { return ext.writeHeader(entry); });
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - writer_header failed: " + ext.errStr(), code);
+		} else if(archive_entry_size(entry) > 0) {
+			code = copyData(a, ext, noVerify, stats, status, false);
+			if(code < ARCHIVE_WARN) break;
+		}
+		code = timed(stats.diskNs, [&] { return ext.finishEntry(); });
+		if(code < ARCHIVE_OK) {
+			status.fail("extract - write_finish_entry failed: " + ext.errStr(), code);
+		}
+		if(code < ARCHIVE_WARN) break;
+	}
+	if(id == 0 && code >= ARCHIVE_WARN && !status.aborted) filter.reportUnmatched(status);
+	archive_read_close(a);
+	archive_read_free(a);
+}
+
+// True if the members can be written in any order: only regular files and directories, and no
+// file at a path that another member places below it. Otherwise the threads' timing would decide
+// what a path ends up being, or whether a file is created through a symlink.
+static bool zipMembersIndependent(const ListColumns &cols)
+{
+	std::unordered_set<std::string> parents;
+	std::vector<std::string> files;
+	for(size_t i = 0; i < cols.paths.size(); ++i) {
+		if(cols.types[i] != AE_IFREG && cols.types[i] != AE_IFDIR) return false;
+		std::string path = cols.paths[i];
+		while(!path.empty() && path.back() == '/') path.pop_back();
+		for(size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+			parents.insert(path.substr(0, pos));
+		}
+		if(cols.types[i] == AE_IFREG) files.push_back(std::move(path));
+	}
+	for(auto &file : files) {
+		if(parents.count(file)) return false;
+	}
+	return true;
+}
+
+// Zip members are compressed independently, so each of `opts.threads` threads decompresses and
+// writes its share of them. The calling thread only reports progress until they are done.
+static int extractZipParallel(const ExtractOptions &opts, const ListColumns &cols,
+			      ArchiveStats &stats, ArchiveStatus &status)
+{
+	size_t threads = opts.threads;
+	ZipOwners owners;
+	assignZipMembers(cols, threads, owners);
+
+	std::vector<std::unique_ptr<DiskWriter>> exts;
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::condition_variable finished;
+	size_t running = threads;
+	// all writers are created before the workers start, see processUmask()
+	for(size_t i = 0; i < threads; ++i) exts.emplace_back(new DiskWriter(opts));
+	for(size_t i = 0; i < threads; ++i) {
+		workers.emplace_back([&, i]() {
+			extractZipWorker(i, threads, opts, owners, *exts[i], stats, status);
+			std::lock_guard<std::mutex> lock(mtx);
+			--running;
+			finished.notify_one();
+		});
+	}
+	std::unique_lock<std::mutex> lock(mtx);
+	while(!finished.wait_for(lock, std::chrono::milliseconds(50), [&] { return running == 0; })) {
+		lock.unlock();
+		extractProgress(stats, status);
+		lock.lock();
+	}
+	lock.unlock();
+	for(auto &worker : workers) worker.join();
+	// closing applies the deferred directory metadata
+	exts.clear();
+	if(status.aborted) return status.fatalCode;
+	return status.errors.empty() ? ARCHIVE_OK : ARCHIVE_WARN;
+}
+
+static int extractArchive(archive *a, const ExtractOptions &opts, ArchiveStats &stats,
+			  ArchiveStatus &status)
+{
+	ListColumns cols;
+	if(!opts.zipPath.empty() &&
+	   timed(stats.ioNs, [&] { return listZipDirectory(opts.zipPath, cols); }) &&
+	   zipMembersIndependent(cols))
+	{
+		return extractZipParallel(opts, cols, stats, status);
+	}
+	ExtractFilter filter(opts);
+	ChecksumVerifier verifier(opts.verify);
+	std::string err;
+	if(!opts.checksums.empty() && !verifier.loadSidecar(opts.checksums, err)) {
+		status.fail("extract - " + err, ARCHIVE_FATAL);
+		return ARCHIVE_FATAL;
+	}
+	int code = opts.threads == 0 ? extractSerial(a, opts, filter, verifier, stats, status)
+				     : extractPipelined(a, opts, filter, verifier, stats, status);
+	if(code >= ARCHIVE_WARN) {
+		filter.reportUnmatched(status);
+		verifier.finish(status);
+		if(status.aborted) return status.fatalCode;
+		if(code == ARCHIVE_OK && !status.errors.empty()) code = ARCHIVE_WARN;
+	}
+	return code;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool parseExtractOptions(Interpreter &vm, ModuleLoc loc,
+				const StringMap<AssnArgData> &assn_args, ExtractOptions &opts)
+{
+	int64_t threads	  = opts.threads;
+	int64_t queueSize = opts.queueSize;
+	int64_t strip	  = opts.strip;
+	int64_t flags	  = opts.flags;
+	int64_t verify	  = opts.verify;
+	bool sparse	  = false;
+	if(!assnArgBool(vm, assn_args, "fast", opts.fast) ||
+	   !assnArgBool(vm, assn_args, "incremental", opts.incremental))
+	{
+		return false;
+	}
+	if(opts.fast) flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM;
+	if(!assnArgInt(vm, assn_args, "threads", threads) ||
+	   !assnArgInt(vm, assn_args, "flags", flags) ||
+	   !assnArgInt(vm, assn_args, "queueSize", queueSize) ||
+	   !assnArgBool(vm, assn_args, "sparse", sparse) ||
+	   !assnArgStrVec(vm, assn_args, "include", opts.include) ||
+	   !assnArgStrVec(vm, assn_args, "exclude", opts.exclude) ||
+	   !assnArgStrVec(vm, assn_args, "paths", opts.paths) ||
+	   !assnArgInt(vm, assn_args, "strip", strip) ||
+	   !assnArgStr(vm, assn_args, "prefix", opts.prefix) ||
+	   !assnArgInt(vm, assn_args, "verify", verify) ||
+	   !assnArgStr(vm, assn_args, "checksums", opts.checksums))
+	{
+		return false;
+	}
+	if(verify != CHECKSUM_NONE && verify != CHECKSUM_CRC32C && verify != CHECKSUM_XXH64) {
+		vm.fail(loc, "extract - invalid checksum algorithm: ", verify);
+		return false;
+	}
+	if(threads < 0) {
+		vm.fail(loc, "extract - thread count cannot be negative, found: ", threads);
+		return false;
+	}
+	if(queueSize <= 0) {
+		vm.fail(loc, "extract - queue size must be positive, found: ", queueSize);
+		return false;
+	}
+	if(strip < 0) {
+		vm.fail(loc, "extract - strip count cannot be negative, found: ", strip);
+		return false;
+	}
+	opts.threads   = threads;
+	opts.queueSize = queueSize;
+	opts.strip     = strip;
+	opts.flags     = flags;
+	opts.verify    = verify;
+	// holes of sparse entries are always recreated, as data blocks are written at their offsets
+	if(sparse) opts.flags |= ARCHIVE_EXTRACT_SPARSE;
+	return true;
+}
+
+// Lets extractArchive() decompress a zip file with one handle per thread, if the archive was
+// set up for FORMAT_ZIP alone without filters, opened from a file and not read yet. The options
+// that need every entry read in order, on a single thread, keep using the archive's handle.
+static void useParallelZip(VarArchive *ar, ExtractOptions &opts)
+{
+	if(opts.threads == 0 || opts.incremental || opts.verify != CHECKSUM_NONE ||
+	   !opts.checksums.empty() || !ar->isZipOnly() || !ar->isUnread() || ar->getPath().empty())
+	{
+		return;
+	}
+	opts.zipPath  = ar->getPath();
+	opts.zipSetup = ar->getSetup();
+}
+
+// extract(threads = 0, queueSize = 64MiB, sparse = false, flags = EXTRACT_*, fast = false,
+//	   include = vec, exclude = vec, paths = vec, strip = 0, prefix = '', incremental = false,
+//	   verify = CHECKSUM_NONE, checksums = '')
+// threads > 0 decouples decompression from disk writes using that many writer threads, or for
+// zip files that were not read from yet by a reader set up for FORMAT_ZIP alone, decompresses
+// that many members at once
+// sparse = true also turns runs of zeros in non-sparse entries into holes
+// flags defaults to EXTRACT_TIME | EXTRACT_PERM | EXTRACT_ACL | EXTRACT_FFLAGS, or to
+// EXTRACT_TIME | EXTRACT_PERM with fast = true, which also skips user/group name lookups
+// include/exclude take glob patterns, paths exact paths; both also match directory contents
+// incremental = true applies the deletions recorded by addTree/addFiles incremental runs
+// verify = CHECKSUM_* checks the data against the archive's setChecksum() manifest, which is only
+// read at the end; checksums = file checks each entry as it is read against a sidecar instead
+Var *feralArchiveExtract(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			 const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	ExtractOptions opts;
+	if(!parseExtractOptions(vm, loc, assn_args, opts)) return nullptr;
+	useParallelZip(ar, opts);
+
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, ar);
+	ar->nextReadGen();
+	int code = extractArchive(ar->get(), opts, ar->getStats(), status);
+	for(auto &err : status.errors) vm.fail(loc, err);
+	return vm.makeVar<VarInt>(loc, code);
+}
+
+// extractAsync(...) -> ArchiveTask
+// Same arguments as extract(), which runs on a worker thread; the task's wait() returns the code.
+// The progress callback is not called, use the task's progress() instead.
+Var *feralArchiveExtractAsync(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	ExtractOptions opts;
+	if(!parseExtractOptions(vm, loc, assn_args, opts)) return nullptr;
+	useParallelZip(ar, opts);
+	archive *a	    = ar->get();
+	ArchiveStats *stats = &ar->getStats();
+	return startArchiveTask(vm, loc, ar, [a, opts, stats](ArchiveStatus &status) {
+		return extractArchive(a, opts, *stats, status);
+	});
+}
@@ -1,7 +1,52 @@
 #pragma once
 
+#include <algorithm>
+#include <thread>
+
 #include "ArchiveType.hpp"
 
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// libarchive function adding the filter to a reader or writer, nullptr if there is none
+static ArchiveSetupFn filterSetup(OpenMode mode, int filter)
+{
+	bool read = mode == OM_READ;
+	// list available here:
+	// https://github.com/libarchive/libarchive/blob/c400064a1c63d122340d09d8ce3f671d4cf24b6e/libarchive/archive.h#L266
+	switch(filter) {
+	case ARCHIVE_FILTER_NONE:
+		return read ? archive_read_support_filter_none : archive_write_add_filter_none;
+	case ARCHIVE_FILTER_GZIP:
+		return read ? archive_read_support_filter_gzip : archive_write_add_filter_gzip;
+	case ARCHIVE_FILTER_BZIP2:
+		return read ? archive_read_support_filter_bzip2 : archive_write_add_filter_bzip2;
+	case ARCHIVE_FILTER_COMPRESS:
+		return read ? archive_read_support_filter_compress : archive_write_add_filter_compress;
+	case ARCHIVE_FILTER_LZMA:
+		return read ? archive_read_support_filter_lzma : archive_write_add_filter_lzma;
+	case ARCHIVE_FILTER_XZ:
+		return read ? archive_read_support_filter_xz : archive_write_add_filter_xz;
+	case ARCHIVE_FILTER_UU:
+		return read ? archive_read_support_filter_uu : archive_write_add_filter_uuencode;
+	case ARCHIVE_FILTER_RPM: return read ? archive_read_support_filter_rpm : nullptr;
+	case ARCHIVE_FILTER_LZIP:
+		return read ? archive_read_support_filter_lzip : archive_write_add_filter_lzip;
+	case ARCHIVE_FILTER_LRZIP:
+		return read ? archive_read_support_filter_lrzip : archive_write_add_filter_lrzip;
+	case ARCHIVE_FILTER_LZOP:
+		return read ? archive_read_support_filter_lzop : archive_write_add_filter_lzop;
+	case ARCHIVE_FILTER_GRZIP:
+		return read ? archive_read_support_filter_grzip : archive_write_add_filter_grzip;
+	case ARCHIVE_FILTER_LZ4:
+		return read ? archive_read_support_filter_lz4 : archive_write_add_filter_lz4;
+	case ARCHIVE_FILTER_ZSTD:
+		return read ? archive_read_support_filter_zstd : archive_write_add_filter_zstd;
+	}
+	return nullptr;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////// Functions ////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -10,38 +55,15 @@ Var *feralArchiveApplyFilter(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 			     const StringMap<AssnArgData> &assn_args)
 {
 	VarArchive *ar = as<VarArchive>(args[0]);
-	archive *a     = ar->get();
 	if(!args[1]->is<VarInt>()) {
 		vm.fail(args[1]->getLoc(),
 			"expected filter id to be of type 'int', found: ", vm.getTypeName(args[1]));
 		return nullptr;
 	}
 
-	// list available here:
-	// https://github.com/libarchive/libarchive/blob/c400064a1c63d122340d09d8ce3f671d4cf24b6e/libarchive/archive.h#L266
 	int filter = as<VarInt>(args[1])->get();
-	switch(filter) {
-	case ARCHIVE_FILTER_NONE: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_none(a);
-		else archive_write_add_filter_none(a);
-		break;
-	}
-	case ARCHIVE_FILTER_GZIP: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_gzip(a);
-		else archive_write_add_filter_gzip(a);
-		break;
-	}
-	case ARCHIVE_FILTER_BZIP2: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_bzip2(a);
-		else archive_write_add_filter_bzip2(a);
-		break;
-	}
-	case ARCHIVE_FILTER_COMPRESS: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_compress(a);
-		else archive_write_add_filter_compress(a);
-		break;
-	}
-	case ARCHIVE_FILTER_PROGRAM: {
+	ArchiveSetupFn setup;
+	if(filter == ARCHIVE_FILTER_PROGRAM) {
 		if(args.size() < 3) {
 			vm.fail(loc, "expected filter program to be passed as third argument");
 			return nullptr;
@@ -52,68 +74,127 @@ Var *feralArchiveApplyFilter(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
 				vm.getTypeName(args[2]));
 			return nullptr;
 		}
-		if(ar->getMode() == OM_READ)
-			archive_read_support_filter_program(a, as<VarStr>(args[2])->get().c_str());
-		else archive_write_add_filter_program(a, as<VarStr>(args[2])->get().c_str());
-		break;
-	}
-	case ARCHIVE_FILTER_LZMA: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_lzma(a);
-		else archive_write_add_filter_lzma(a);
-		break;
+		std::string program = as<VarStr>(args[2])->get();
+		if(ar->getMode() == OM_READ) {
+			setup = [program](archive *a) {
+				return archive_read_support_filter_program(a, program.c_str());
+			};
+		} else {
+			setup = [program](archive *a) {
+				return archive_write_add_filter_program(a, program.c_str());
+			};
+		}
+	} else if(filter == ARCHIVE_FILTER_RPM && ar->getMode() != OM_READ) {
+		vm.fail(args[1]->getLoc(), "filter type RPM not implemented for writer");
+		return nullptr;
+	} else {
+		setup = filterSetup(ar->getMode(), filter);
 	}
-	case ARCHIVE_FILTER_XZ: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_xz(a);
-		else archive_write_add_filter_xz(a);
-		break;
+	if(!setup) {
+		vm.fail(loc, "invalid filter found: ", filter);
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_UU: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_uu(a);
-		else archive_write_add_filter_uuencode(a);
-		break;
+	if(ar->applySetup(setup) >= ARCHIVE_WARN) ar->addSetupFilter(filter);
+	return args[0];
+}
+
+// converts a feral value to the string form expected by libarchive's option setters
+static bool archiveOptionValue(Var *v, std::string &out)
+{
+	if(v->is<VarStr>()) out = as<VarStr>(v)->get();
+	else if(v->is<VarInt>()) out = std::to_string(as<VarInt>(v)->get());
+	else if(v->is<VarBool>()) out = as<VarBool>(v)->get() ? "1" : "";
+	else return false;
+	return true;
+}
+
+Var *feralArchiveSetFilterOption(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+				 const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected filter name to be of type 'str', found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_RPM: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_rpm(a);
-		else {
-			vm.fail(args[2]->getLoc(), "filter type RPM not implemented for writer");
-			return nullptr;
-		}
-		break;
+	if(!args[2]->is<VarStr>()) {
+		vm.fail(args[2]->getLoc(), "expected option name to be of type 'str', found: ",
+			vm.getTypeName(args[2]));
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_LZIP: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_lzip(a);
-		else archive_write_add_filter_lzip(a);
-		break;
+	std::string value;
+	if(!archiveOptionValue(args[3], value)) {
+		vm.fail(args[3]->getLoc(),
+			"expected option value to be of type 'str', 'int', or 'bool', found: ",
+			vm.getTypeName(args[3]));
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_LRZIP: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_lrzip(a);
-		else archive_write_add_filter_lrzip(a);
-		break;
+	std::string filter = as<VarStr>(args[1])->get();
+	std::string option = as<VarStr>(args[2])->get();
+	bool read	   = ar->getMode() == OM_READ;
+
+	ArchiveSetupFn setup = [filter, option, value, read](archive *a) {
+		// empty filter name applies the option to every filter that recognizes it
+		const char *module = filter.empty() ? nullptr : filter.c_str();
+		const char *val	   = value.empty() ? nullptr : value.c_str();
+		if(read) return archive_read_set_filter_option(a, module, option.c_str(), val);
+		return archive_write_set_filter_option(a, module, option.c_str(), val);
+	};
+	if(ar->applySetup(setup) != ARCHIVE_OK) {
+		vm.fail(loc, "failed to set filter option '", as<VarStr>(args[2])->get(),
+			"': ", archive_error_string(a));
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_LZOP: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_lzop(a);
-		else archive_write_add_filter_lzop(a);
-		break;
+	return args[0];
+}
+
+// Sets the number of compression worker threads for all filters that support it (zstd, xz).
+// Must be called after addFilter(). Zero means use all available cores.
+Var *feralArchiveSetThreads(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			    const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+	if(!args[1]->is<VarInt>()) {
+		vm.fail(args[1]->getLoc(), "expected thread count to be of type 'int', found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_GRZIP: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_grzip(a);
-		else archive_write_add_filter_grzip(a);
-		break;
+	if(ar->getMode() != OM_WRITE) {
+		vm.fail(loc, "threaded compression is only available for archives in write mode");
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_LZ4: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_lz4(a);
-		else archive_write_add_filter_lz4(a);
-		break;
+	int64_t threads = as<VarInt>(args[1])->get();
+	if(threads < 0) {
+		vm.fail(args[1]->getLoc(), "thread count cannot be negative, found: ", threads);
+		return nullptr;
 	}
-	case ARCHIVE_FILTER_ZSTD: {
-		if(ar->getMode() == OM_READ) archive_read_support_filter_zstd(a);
-		else archive_write_add_filter_zstd(a);
-		break;
+	if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+	std::string value = std::to_string(threads);
+	bool applied = false;
+	for(int i = 0; i < archive_filter_count(a); ++i) {
+		const char *module = nullptr;
+		switch(archive_filter_code(a, i)) {
+		case ARCHIVE_FILTER_ZSTD: module = "zstd"; break;
+		case ARCHIVE_FILTER_XZ: module = "xz"; break;
+		default: continue;
+		}
+		int code = ar->applySetup([module, value](archive *a) {
+			return archive_write_set_filter_option(a, module, "threads", value.c_str());
+		});
+		if(code != ARCHIVE_OK) {
+			vm.fail(loc, "failed to set thread count for filter '", module,
+				"': ", archive_error_string(a));
+			return nullptr;
+		}
+		applied = true;
 	}
-	default: {
-		vm.fail(loc, "invalid filter found: ", filter);
+	if(!applied) {
+		vm.fail(loc, "none of the archive's filters support threaded compression"
+			     " (supported: FILTER_ZSTD, FILTER_XZ)");
 		return nullptr;
 	}
-	}
 	return args[0];
-}
\ No newline at end of file
+}
@@ -1,96 +1,88 @@
 #pragma once
 
-#include "ArchiveType.hpp"
+#include "ArchiveUtils.hpp"
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
-Var *feralArchiveApplyFormat(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
-			     const StringMap<AssnArgData> &assn_args)
+// libarchive function enabling the format of a reader or setting the one of a writer, nullptr if
+// there is none
+static ArchiveSetupFn formatSetup(OpenMode mode, int format)
 {
-	VarArchive *ar = as<VarArchive>(args[0]);
-	archive *a     = ar->get();
-	if(!args[1]->is<VarInt>()) {
-		vm.fail(args[1]->getLoc(),
-			"expected format id to be of type 'int', found: ", vm.getTypeName(args[1]));
-		return nullptr;
-	}
+	bool read = mode == OM_READ;
 	// list available here:
 	// https://github.com/libarchive/libarchive/blob/c400064a1c63d122340d09d8ce3f671d4cf24b6e/libarchive/archive.h#L312
-	int format = as<VarInt>(args[1])->get();
-
 	switch(format) {
-	case ARCHIVE_FORMAT_CPIO: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_cpio(a);
-		else archive_write_set_format_cpio(a);
-		break;
-	}
+	case ARCHIVE_FORMAT_CPIO:
+		return read ? archive_read_support_format_cpio : archive_write_set_format_cpio;
 	case ARCHIVE_FORMAT_TAR_USTAR:
+		return read ? archive_read_support_format_tar : archive_write_set_format_ustar;
 	case ARCHIVE_FORMAT_TAR_PAX_INTERCHANGE:
+		return read ? archive_read_support_format_tar : archive_write_set_format_pax;
 	case ARCHIVE_FORMAT_TAR_PAX_RESTRICTED:
+		return read ? archive_read_support_format_tar
+			    : archive_write_set_format_pax_restricted;
 	case ARCHIVE_FORMAT_TAR_GNUTAR:
-	case ARCHIVE_FORMAT_TAR: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_tar(a);
-		else {
-			if(format == ARCHIVE_FORMAT_TAR_USTAR) {
-				archive_write_set_format_ustar(a);
-			} else if(format == ARCHIVE_FORMAT_TAR_PAX_INTERCHANGE) {
-				archive_write_set_format_pax(a);
-			} else if(format == ARCHIVE_FORMAT_TAR_PAX_RESTRICTED) {
-				archive_write_set_format_pax_restricted(a);
-			} else if(format == ARCHIVE_FORMAT_TAR_GNUTAR) {
-				archive_write_set_format_gnutar(a);
-			} else {
-				vm.fail(
-				args[1]->getLoc(),
-				"required specific writing format for tar: one of "
-				"FORMAT_TAR_{USTAR, PAX_INTERCHANGE, PAX_RESTRICTED, GNUTAR}");
-				return nullptr;
-			}
-		}
-		break;
-	}
-	case ARCHIVE_FORMAT_ZIP: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_zip(a);
-		else archive_write_set_format_zip(a);
-		break;
-	}
+		return read ? archive_read_support_format_tar : archive_write_set_format_gnutar;
+	case ARCHIVE_FORMAT_TAR: return read ? archive_read_support_format_tar : nullptr;
+	case ARCHIVE_FORMAT_ZIP:
+		return read ? archive_read_support_format_zip : archive_write_set_format_zip;
 	case ARCHIVE_FORMAT_AR:
-	case ARCHIVE_FORMAT_AR_BSD: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_ar(a);
-		else archive_write_set_format_ar_bsd(a);
-		break;
-	}
-	case ARCHIVE_FORMAT_MTREE: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_mtree(a);
-		else archive_write_set_format_mtree(a);
-		break;
-	}
-	case ARCHIVE_FORMAT_RAW: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_raw(a);
-		else archive_write_set_format_raw(a);
-		break;
-	}
-	case ARCHIVE_FORMAT_XAR: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_xar(a);
-		else archive_write_set_format_xar(a);
-		break;
+	case ARCHIVE_FORMAT_AR_BSD:
+		return read ? archive_read_support_format_ar : archive_write_set_format_ar_bsd;
+	case ARCHIVE_FORMAT_MTREE:
+		return read ? archive_read_support_format_mtree : archive_write_set_format_mtree;
+	case ARCHIVE_FORMAT_RAW:
+		return read ? archive_read_support_format_raw : archive_write_set_format_raw;
+	case ARCHIVE_FORMAT_XAR:
+		return read ? archive_read_support_format_xar : archive_write_set_format_xar;
+	case ARCHIVE_FORMAT_7ZIP:
+		return read ? archive_read_support_format_7zip : archive_write_set_format_7zip;
+	case ARCHIVE_FORMAT_WARC:
+		return read ? archive_read_support_format_warc : archive_write_set_format_warc;
 	}
-	case ARCHIVE_FORMAT_7ZIP: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_7zip(a);
-		else archive_write_set_format_7zip(a);
-		break;
+	return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// setFormat(format, adaptive = false)
+// adaptive = true makes a zip writer store entries whose sampled data looks incompressible and
+// deflate the others, at the fastest level if they would shrink only a little. Applies to data
+// added by addFile/addTree/addFiles; entries from writeHeader() are always deflated.
+Var *feralArchiveApplyFormat(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			     const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	if(!args[1]->is<VarInt>()) {
+		vm.fail(args[1]->getLoc(),
+			"expected format id to be of type 'int', found: ", vm.getTypeName(args[1]));
+		return nullptr;
 	}
-	case ARCHIVE_FORMAT_WARC: {
-		if(ar->getMode() == OM_READ) archive_read_support_format_warc(a);
-		else archive_write_set_format_warc(a);
-		break;
+	int format = as<VarInt>(args[1])->get();
+	if(format == ARCHIVE_FORMAT_TAR && ar->getMode() == OM_WRITE) {
+		vm.fail(args[1]->getLoc(),
+			"required specific writing format for tar: one of "
+			"FORMAT_TAR_{USTAR, PAX_INTERCHANGE, PAX_RESTRICTED, GNUTAR}");
+		return nullptr;
 	}
-	default: {
+	ArchiveSetupFn setup = formatSetup(ar->getMode(), format);
+	if(!setup) {
 		vm.fail(args[1]->getLoc(), "invalid format found: ", format);
 		return nullptr;
 	}
+	bool adaptive = false;
+	if(!assnArgBool(vm, assn_args, "adaptive", adaptive)) return nullptr;
+	// 7z compresses all entries as a single stream, set up with the first one
+	if(adaptive && (ar->getMode() != OM_WRITE || format != ARCHIVE_FORMAT_ZIP)) {
+		vm.fail(loc, "adaptive compression is only available when writing zip archives");
+		return nullptr;
 	}
+	// only applied once all arguments are valid, a failed call leaves the archive as it was
+	if(ar->applySetup(setup) >= ARCHIVE_WARN) ar->addSetupFormat(format);
+	ar->setAdaptive(adaptive);
 	return args[0];
 }
\ No newline at end of file
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////// XXH64 //////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md). Four
+// independent lanes per 32 byte stripe, which compilers keep in registers or vectorize.
+class XXH64
+{
+	static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t P3 = 0x165667B19E3779F9ULL;
+	static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+	static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+	uint64_t lanes[4];
+	uint64_t total;
+	unsigned char pending[32];
+	size_t pendingLen;
+	uint64_t seed;
+
+	static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static inline uint64_t read64(const unsigned char *p)
+	{
+		uint64_t v;
+		memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		return v;
+	}
+	static inline uint32_t read32(const unsigned char *p)
+	{
+		uint32_t v;
+		memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap32(v);
+#endif
+		return v;
+	}
+	static inline uint64_t round(uint64_t acc, uint64_t input)
+	{
+		acc += input * P2;
+		acc = rotl(acc, 31);
+		return acc * P1;
+	}
+	static inline uint64_t merge(uint64_t acc, uint64_t lane)
+	{
+		acc ^= round(0, lane);
+		return acc * P1 + P4;
+	}
+	inline void stripe(const unsigned char *p)
+	{
+		lanes[0] = round(lanes[0], read64(p));
+		lanes[1] = round(lanes[1], read64(p + 8));
+		lanes[2] = round(lanes[2], read64(p + 16));
+		lanes[3] = round(lanes[3], read64(p + 24));
+	}
+
+public:
+	XXH64(uint64_t seed = 0) : total(0), pendingLen(0), seed(seed)
+	{
+		lanes[0] = seed + P1 + P2;
+		lanes[1] = seed + P2;
+		lanes[2] = seed;
+		lanes[3] = seed - P1;
+	}
+
+	void update(const void *data, size_t len)
+	{
+		const unsigned char *p = (const unsigned char *)data;
+		total += len;
+		if(pendingLen > 0) {
+			size_t fill = std::min(len, 32 - pendingLen);
+			memcpy(pending + pendingLen, p, fill);
+			pendingLen += fill;
+			p += fill;
+			len -= fill;
+			if(pendingLen < 32) return;
+			stripe(pending);
+			pendingLen = 0;
+		}
+		for(; len >= 32; p += 32, len -= 32) stripe(p);
+		memcpy(pending, p, len);
+		pendingLen = len;
+	}
+
+	uint64_t digest() const
+	{
+		uint64_t h;
+		if(total >= 32) {
+			h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+			    rotl(lanes[3], 18);
+			for(int i = 0; i < 4; ++i) h = merge(h, lanes[i]);
+		} else {
+			h = seed + P5;
+		}
+		h += total;
+		const unsigned char *p = pending, *end = pending + pendingLen;
+		for(; p + 8 <= end; p += 8) {
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * P1 + P4;
+		}
+		if(p + 4 <= end) {
+			h ^= (uint64_t)read32(p) * P1;
+			h = rotl(h, 23) * P2 + P3;
+			p += 4;
+		}
+		for(; p < end; ++p) {
+			h ^= (*p) * P5;
+			h = rotl(h, 11) * P1;
+		}
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	static uint64_t hash(const void *data, size_t len, uint64_t seed = 0)
+	{
+		XXH64 state(seed);
+		state.update(data, len);
+		return state.digest();
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////// CRC32C /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ARCHIVE_CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+// Streaming CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it, checked
+// at runtime, and slicing-by-8 tables otherwise.
+class CRC32C
+{
+	uint32_t crc;
+
+	static const uint32_t (*tables())[256]
+	{
+		static uint32_t t[8][256];
+		static bool init = [] {
+			for(uint32_t i = 0; i < 256; ++i) {
+				uint32_t c = i;
+				for(int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+				t[0][i] = c;
+			}
+			for(uint32_t i = 0; i < 256; ++i) {
+				for(int k = 1; k < 8; ++k) {
+					t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+				}
+			}
+			return true;
+		}();
+		(void)init;
+		return t;
+	}
+
+	static uint32_t updateTable(uint32_t crc, const unsigned char *p, size_t len)
+	{
+		const uint32_t(*t)[256] = tables();
+		for(; len >= 8; p += 8, len -= 8) {
+			uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+					     (uint32_t)p[3] << 24);
+			uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 |
+				      (uint32_t)p[7] << 24;
+			crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^
+			      t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+			      t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		}
+		for(; len > 0; ++p, --len) crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+		return crc;
+	}
+
+#ifdef ARCHIVE_CRC32C_SSE42
+	__attribute__((target("sse4.2"))) static uint32_t updateSse42(uint32_t crc,
+								       const unsigned char *p,
+								       size_t len)
+	{
+		uint64_t c = crc;
+		for(; len >= 8; p += 8, len -= 8) {
+			uint64_t v;
+			memcpy(&v, p, 8);
+			c = _mm_crc32_u64(c, v);
+		}
+		uint32_t c32 = (uint32_t)c;
+		for(; len > 0; ++p, --len) c32 = _mm_crc32_u8(c32, *p);
+		return c32;
+	}
+	static bool hasSse42()
+	{
+		static bool has = __builtin_cpu_supports("sse4.2");
+		return has;
+	}
+#endif
+
+public:
+	CRC32C() : crc(0xFFFFFFFF) {}
+
+	void update(const void *data, size_t len)
+	{
+		const unsigned char *p = (const unsigned char *)data;
+#ifdef ARCHIVE_CRC32C_SSE42
+		if(hasSse42()) {
+			crc = updateSse42(crc, p, len);
+			return;
+		}
+#endif
+		crc = updateTable(crc, p, len);
+	}
+
+	uint32_t digest() const { return crc ^ 0xFFFFFFFF; }
+
+	static uint32_t hash(const void *data, size_t len)
+	{
+		CRC32C state;
+		state.update(data, len);
+		return state.digest();
+	}
+};
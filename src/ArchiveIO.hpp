@@ -0,0 +1,465 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <std/BytebufferType.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////// Clients ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Keeps the source bytebuffer alive while libarchive reads directly from its storage.
+class MemorySource : public ArchiveClient
+{
+	VarBytebuffer *buf;
+
+public:
+	MemorySource(VarBytebuffer *buf) : buf(buf) { incref(buf); }
+	~MemorySource() { decref(buf); }
+};
+
+// Appends the written archive to the target bytebuffer's own storage, which is grown in place
+// (doubling its size), so the bytebuffer always holds the output so far and is never copied.
+class MemorySink : public ArchiveClient
+{
+	VarBytebuffer *out;
+	// bytes allocated for the bytebuffer's storage; capacity() only knows its initial size
+	size_t allocated;
+
+public:
+	MemorySink(VarBytebuffer *out) : out(out), allocated(out->capacity())
+	{
+		incref(out);
+		out->setLen(0);
+	}
+	~MemorySink() { decref(out); }
+
+	static la_ssize_t write(archive *a, void *self, const void *buff, size_t len)
+	{
+		MemorySink *sink   = (MemorySink *)self;
+		VarBytebuffer *out = sink->out;
+		size_t used	   = out->len();
+		return timed(sink->stats->ioNs, [&]() -> la_ssize_t {
+			if(used + len > sink->allocated) {
+				size_t size = std::max({sink->allocated * 2, used + len,
+							(size_t)64 * 1024});
+				char *grown = (char *)realloc(out->getBuf(), size);
+				if(!grown) {
+					archive_set_error(a, ENOMEM, "failed to grow the bytebuffer");
+					return ARCHIVE_FATAL;
+				}
+				out->getBuf()	= grown;
+				sink->allocated = size;
+			}
+			memcpy(out->getBuf() + used, buff, len);
+			out->setLen(used + len);
+			return len;
+		});
+	}
+};
+
+// Serves a memory mapped file to libarchive in windows of `window` bytes, advising the kernel to
+// read ahead the window that follows the one being handed out.
+class MmapSource : public ArchiveClient
+{
+	int fd;
+	char *base;
+	size_t size;
+	size_t pos;
+	size_t window;
+
+public:
+	MmapSource(int fd, char *base, size_t size, size_t window)
+		: fd(fd), base(base), size(size), pos(0), window(window)
+	{
+		madvise(base, size, MADV_SEQUENTIAL);
+	}
+	~MmapSource()
+	{
+		munmap(base, size);
+		::close(fd);
+	}
+
+	// returns nullptr if the file cannot be mapped (pipes, devices, empty files, ...)
+	static MmapSource *create(const std::string &name, size_t window)
+	{
+		int fd = ::open(name.c_str(), O_RDONLY);
+		if(fd < 0) return nullptr;
+		struct stat st;
+		if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			::close(fd);
+			return nullptr;
+		}
+		void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(base == MAP_FAILED) {
+			::close(fd);
+			return nullptr;
+		}
+		return new MmapSource(fd, (char *)base, st.st_size, window);
+	}
+
+	static la_ssize_t read(archive *a, void *self, const void **buff)
+	{
+		MmapSource *src = (MmapSource *)self;
+		size_t len	= std::min(src->window, src->size - src->pos);
+		*buff		= src->base + src->pos;
+		src->pos += len;
+		if(src->pos < src->size) {
+			// madvise() requires a page aligned address
+			size_t page  = sysconf(_SC_PAGESIZE);
+			size_t ahead = src->pos & ~(page - 1);
+			timed(src->stats->ioNs, [&] {
+				return madvise(src->base + ahead,
+					       std::min(src->window, src->size - ahead), MADV_WILLNEED);
+			});
+		}
+		return len;
+	}
+	static la_int64_t skip(archive *a, void *self, la_int64_t request)
+	{
+		MmapSource *src = (MmapSource *)self;
+		size_t len	= std::min((size_t)request, src->size - src->pos);
+		src->pos += len;
+		return len;
+	}
+	static la_int64_t seek(archive *a, void *self, la_int64_t offset, int whence)
+	{
+		MmapSource *src = (MmapSource *)self;
+		la_int64_t pos	= offset;
+		if(whence == SEEK_CUR) pos += src->pos;
+		else if(whence == SEEK_END) pos += src->size;
+		if(pos < 0) return ARCHIVE_FATAL;
+		src->pos = std::min((size_t)pos, src->size);
+		return src->pos;
+	}
+};
+
+// Reads an archive file from the descriptor's current offset into the archive's read buffer,
+// which outlives the source so that reopening after reset() does not allocate it again.
+class FileSource : public ArchiveClient
+{
+	int fd;
+	std::vector<char> &buf;
+	// descriptors passed in by the caller are left open
+	bool own;
+
+public:
+	FileSource(int fd, std::vector<char> &buf, size_t blockSize, bool own = true)
+		: fd(fd), buf(buf), own(own)
+	{
+		buf.resize(blockSize);
+	}
+	~FileSource()
+	{
+		if(own) ::close(fd);
+	}
+
+	// also sets the skip and seek callbacks for regular files
+	int open(archive *a)
+	{
+		struct stat st;
+		if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			archive_read_set_skip_callback(a, skip);
+			archive_read_set_seek_callback(a, seek);
+		}
+		archive_read_set_read_callback(a, read);
+		archive_read_set_callback_data(a, this);
+		return archive_read_open1(a);
+	}
+
+	static la_ssize_t read(archive *a, void *self, const void **buff)
+	{
+		FileSource *src = (FileSource *)self;
+		*buff		= src->buf.data();
+		ssize_t len	= timed(src->stats->ioNs,
+					[&] { return ::read(src->fd, src->buf.data(), src->buf.size()); });
+		if(len < 0) archive_set_error(a, errno, "failed to read archive");
+		return len;
+	}
+	static la_int64_t skip(archive *a, void *self, la_int64_t request)
+	{
+		FileSource *src = (FileSource *)self;
+		// libarchive reads through the data instead
+		if(lseek(src->fd, request, SEEK_CUR) < 0) return 0;
+		return request;
+	}
+	static la_int64_t seek(archive *a, void *self, la_int64_t offset, int whence)
+	{
+		FileSource *src = (FileSource *)self;
+		off_t pos	= lseek(src->fd, offset, whence);
+		if(pos < 0) archive_set_error(a, errno, "failed to seek archive");
+		return pos < 0 ? ARCHIVE_FATAL : pos;
+	}
+};
+
+// Pulls the archive from a Feral function returning a bytebuffer or string per call, and nil or
+// an empty one at the end. The returned value is read in place, and released on the next call.
+class CallbackSource : public ArchiveClient
+{
+	Interpreter &vm;
+	ModuleLoc loc;
+	Var *fn;
+	Var *last;
+
+public:
+	CallbackSource(Interpreter &vm, ModuleLoc loc, Var *fn)
+		: vm(vm), loc(loc), fn(fn), last(nullptr)
+	{
+		incref(fn);
+	}
+	~CallbackSource()
+	{
+		if(last) decref(last);
+		decref(fn);
+	}
+
+	bool callsFeral() const override { return true; }
+
+	static la_ssize_t read(archive *a, void *self, const void **buff)
+	{
+		CallbackSource *src = (CallbackSource *)self;
+		if(src->last) decref(src->last);
+		Var *callArgs[1] = {nullptr};
+		Var *res	 = timed(src->stats->ioNs, [&] {
+			return src->vm.callVar(src->loc, "read", src->fn, Span<Var *>{callArgs, 1}, {});
+		});
+		src->last = res;
+		if(!res) {
+			archive_set_error(a, ECANCELED, "read callback failed");
+			return ARCHIVE_FATAL;
+		}
+		if(res->is<VarBytebuffer>()) {
+			*buff = as<VarBytebuffer>(res)->getBuf();
+			return as<VarBytebuffer>(res)->len();
+		}
+		if(res->is<VarStr>()) {
+			*buff = as<VarStr>(res)->get().data();
+			return as<VarStr>(res)->get().size();
+		}
+		if(res->is<VarNil>()) return 0;
+		archive_set_error(a, EINVAL, "read callback must return a bytebuffer, str or nil");
+		return ARCHIVE_FATAL;
+	}
+};
+
+// Pushes the archive to a Feral function, called with a bytebuffer holding each block of output.
+// Returning false from it stops the writer. The bytebuffer is reused across calls.
+class CallbackSink : public ArchiveClient
+{
+	Interpreter &vm;
+	ModuleLoc loc;
+	Var *fn;
+	VarBytebuffer *block;
+
+public:
+	CallbackSink(Interpreter &vm, ModuleLoc loc, Var *fn, size_t blockSize)
+		: vm(vm), loc(loc), fn(fn), block(vm.makeVarWithRef<VarBytebuffer>(loc, blockSize))
+	{
+		incref(fn);
+	}
+	~CallbackSink()
+	{
+		decref(block);
+		decref(fn);
+	}
+
+	bool callsFeral() const override { return true; }
+
+	static la_ssize_t write(archive *a, void *self, const void *buff, size_t len)
+	{
+		CallbackSink *sink = (CallbackSink *)self;
+		sink->block->setData((char *)buff, len);
+		Var *callArgs[2] = {nullptr, sink->block};
+		Var *res	 = timed(sink->stats->ioNs, [&] {
+			return sink->vm.callVar(sink->loc, "write", sink->fn, Span<Var *>{callArgs, 2},
+						{});
+		});
+		if(!res) {
+			archive_set_error(a, ECANCELED, "write callback failed");
+			return ARCHIVE_FATAL;
+		}
+		bool ok = !res->is<VarBool>() || as<VarBool>(res)->get();
+		decref(res);
+		if(!ok) {
+			archive_set_error(a, ECANCELED, "stopped by write callback");
+			return ARCHIVE_FATAL;
+		}
+		return len;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Reader: reads the archive straight out of the bytebuffer, which must not be modified until the
+// archive is closed. Writer: the bytebuffer's contents are replaced by the archive, appended as
+// it is written; it must not be modified either until the archive is closed.
+Var *feralArchiveOpenMemory(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			    const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+
+	if(!args[1]->is<VarBytebuffer>()) {
+		vm.fail(args[1]->getLoc(), "expected a bytebuffer to open as archive, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	VarBytebuffer *bb = as<VarBytebuffer>(args[1]);
+	int code	  = ARCHIVE_OK;
+
+	ar->setOpened();
+	if(ar->getMode() == OM_READ) {
+		ar->setClient(new MemorySource(bb));
+		code = archive_read_open_memory(a, bb->getBuf(), bb->len());
+	} else if(ar->getMode() == OM_WRITE) {
+		MemorySink *sink = new MemorySink(bb);
+		ar->setClient(sink);
+		code = archive_write_open(a, sink, nullptr, MemorySink::write, nullptr);
+	}
+	if(code != ARCHIVE_OK) {
+		vm.fail(loc, "failed to open memory archive in given mode: ", archive_error_string(a));
+		return nullptr;
+	}
+	return args[0];
+}
+
+// openMmap(name, blockSize = 4MiB)
+// Memory maps the archive file and hands libarchive windows of blockSize bytes of the mapping.
+// Falls back to regular reads with the same block size if the file cannot be mapped.
+Var *feralArchiveOpenMmap(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected a string file name to open as archive");
+		return nullptr;
+	}
+	if(ar->getMode() != OM_READ) {
+		vm.fail(loc, "memory mapped archives can only be opened in read mode");
+		return nullptr;
+	}
+	int64_t blockSize = 4 * 1024 * 1024;
+	if(!assnArgInt(vm, assn_args, "blockSize", blockSize)) return nullptr;
+	if(blockSize <= 0) {
+		vm.fail(loc, "block size must be positive, found: ", blockSize);
+		return nullptr;
+	}
+
+	const std::string &name = as<VarStr>(args[1])->get();
+	MmapSource *src		= MmapSource::create(name, blockSize);
+	int code		= ARCHIVE_OK;
+	ar->setOpened();
+	if(src) {
+		ar->setClient(src);
+		archive_read_set_read_callback(a, MmapSource::read);
+		archive_read_set_skip_callback(a, MmapSource::skip);
+		archive_read_set_seek_callback(a, MmapSource::seek);
+		archive_read_set_callback_data(a, src);
+		code = archive_read_open1(a);
+	} else {
+		code = archive_read_open_filename(a, name.c_str(), blockSize);
+	}
+	if(code != ARCHIVE_OK) {
+		vm.fail(loc, "failed to open archive in given mode: ", archive_error_string(a));
+		return nullptr;
+	}
+	ar->setPath(name);
+	return args[0];
+}
+
+// openFd(fd, blockSize = 64KiB)
+// Reads or writes the archive through an open file descriptor (a pipe, socket, stdin/stdout, ...),
+// which is left open by close(). Writers send blockSize bytes per write(), the last block unpadded.
+Var *feralArchiveOpenFd(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+
+	if(!args[1]->is<VarInt>()) {
+		vm.fail(args[1]->getLoc(), "expected file descriptor to be of type 'int', found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	int64_t blockSize = 64 * 1024;
+	if(!assnArgInt(vm, assn_args, "blockSize", blockSize)) return nullptr;
+	if(blockSize <= 0) {
+		vm.fail(loc, "block size must be positive, found: ", blockSize);
+		return nullptr;
+	}
+
+	int fd	 = as<VarInt>(args[1])->get();
+	int code = ARCHIVE_OK;
+	ar->setOpened();
+	if(ar->getMode() == OM_READ) {
+		FileSource *src = new FileSource(fd, ar->getReadBuffer(), blockSize, false);
+		ar->setClient(src);
+		code = src->open(a);
+	} else if(ar->getMode() == OM_WRITE) {
+		archive_write_set_bytes_per_block(a, blockSize);
+		archive_write_set_bytes_in_last_block(a, 1);
+		code = archive_write_open_fd(a, fd);
+	}
+	if(code != ARCHIVE_OK) {
+		vm.fail(loc, "failed to open archive in given mode: ", archive_error_string(a));
+		return nullptr;
+	}
+	return args[0];
+}
+
+// openCallback(fn, blockSize = 1MiB)
+// Reader: fn() returns the next chunk of the archive as a bytebuffer or str, nil at the end.
+// Writer: fn(bytebuffer) receives the output in blocks of blockSize bytes (the last one may be
+// shorter), and returning false from it stops the writer.
+// fn is called from the calling thread, so such archives cannot be used by async tasks.
+Var *feralArchiveOpenCallback(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+
+	if(!args[1]->isCallable()) {
+		vm.fail(args[1]->getLoc(), "expected a callable I/O function, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	int64_t blockSize = 1024 * 1024;
+	if(!assnArgInt(vm, assn_args, "blockSize", blockSize)) return nullptr;
+	if(blockSize <= 0) {
+		vm.fail(loc, "block size must be positive, found: ", blockSize);
+		return nullptr;
+	}
+
+	int code = ARCHIVE_OK;
+	ar->setOpened();
+	if(ar->getMode() == OM_READ) {
+		CallbackSource *src = new CallbackSource(vm, loc, args[1]);
+		ar->setClient(src);
+		code = archive_read_open(a, src, nullptr, CallbackSource::read, nullptr);
+	} else if(ar->getMode() == OM_WRITE) {
+		CallbackSink *sink = new CallbackSink(vm, loc, args[1], blockSize);
+		ar->setClient(sink);
+		// libarchive gathers the output into full blocks before calling the sink
+		archive_write_set_bytes_per_block(a, blockSize);
+		archive_write_set_bytes_in_last_block(a, 1);
+		code = archive_write_open(a, sink, nullptr, CallbackSink::write, nullptr);
+	}
+	if(code != ARCHIVE_OK) {
+		vm.fail(loc, "failed to open archive in given mode: ", archive_error_string(a));
+		return nullptr;
+	}
+	return args[0];
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "ArchiveUtils.hpp"
+
+// Member of an incremental archive listing the paths deleted since the previous manifest, one
+// escaped path per line. Written last, after all new and changed entries.
+#define INCREMENTAL_DELETED_MEMBER ".feral-incremental-deleted"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Manifest ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct ManifestRecord
+{
+	la_int64_t size;
+	la_int64_t mtime;
+	long mtimeNsec;
+	la_int64_t ino;
+	// XXH64 of the contents of regular files, if recorded
+	uint64_t hash;
+	bool hashed;
+};
+
+using Manifest = std::unordered_map<std::string, ManifestRecord>;
+
+// Paths are escaped so that each record stays on one tab separated line.
+static std::string manifestEscape(const std::string &path)
+{
+	std::string res;
+	res.reserve(path.size());
+	for(char c : path) {
+		if(c == '\\') res += "\\\\";
+		else if(c == '\t') res += "\\t";
+		else if(c == '\n') res += "\\n";
+		else res += c;
+	}
+	return res;
+}
+
+static std::string manifestUnescape(const std::string &path)
+{
+	std::string res;
+	res.reserve(path.size());
+	for(size_t i = 0; i < path.size(); ++i) {
+		if(path[i] != '\\' || i + 1 == path.size()) {
+			res += path[i];
+			continue;
+		}
+		char c = path[++i];
+		res += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+	}
+	return res;
+}
+
+// Format, one line per entry: path size mtime mtimeNsec inode hash, tab separated, with hash as
+// 16 hex digits or '-'.
+static bool loadManifest(const std::string &file, Manifest &manifest, std::string &err)
+{
+	std::ifstream in(file);
+	if(!in) {
+		err = "failed to open manifest '" + file + "'";
+		return false;
+	}
+	std::string line;
+	size_t lineNum = 0;
+	while(std::getline(in, line)) {
+		++lineNum;
+		if(line.empty()) continue;
+		size_t tab = line.find('\t');
+		ManifestRecord rec;
+		std::string hash;
+		std::istringstream fields(tab == std::string::npos ? "" : line.substr(tab + 1));
+		if(!(fields >> rec.size >> rec.mtime >> rec.mtimeNsec >> rec.ino >> hash)) {
+			err = "invalid record in manifest '" + file + "' at line " +
+			      std::to_string(lineNum);
+			return false;
+		}
+		rec.hashed = hash != "-";
+		rec.hash   = rec.hashed ? strtoull(hash.c_str(), nullptr, 16) : 0;
+		manifest[manifestUnescape(line.substr(0, tab))] = rec;
+	}
+	return true;
+}
+
+// Written to a temporary file first, so that a failed run keeps the previous manifest intact.
+static bool saveManifest(const std::string &file, const Manifest &manifest, std::string &err)
+{
+	std::vector<const Manifest::value_type *> records;
+	for(auto &rec : manifest) records.push_back(&rec);
+	std::sort(records.begin(), records.end(),
+		  [](const Manifest::value_type *a, const Manifest::value_type *b) {
+			  return a->first < b->first;
+		  });
+	std::string tmp = file + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::trunc);
+		char hash[17];
+		for(auto rec : records) {
+			const ManifestRecord &r = rec->second;
+			if(r.hashed) snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)r.hash);
+			out << manifestEscape(rec->first) << '\t' << r.size << '\t' << r.mtime << '\t'
+			    << r.mtimeNsec << '\t' << r.ino << '\t' << (r.hashed ? hash : "-") << '\n';
+		}
+		if(!out.flush()) {
+			err = "failed to write manifest '" + tmp + "'";
+			return false;
+		}
+	}
+	if(rename(tmp.c_str(), file.c_str()) != 0) {
+		err = "failed to replace manifest '" + file + "': " + strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////// Incremental Writes ///////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Decides which entries of an incremental run are written, and builds the next manifest.
+class IncrementalState
+{
+	Manifest previous;
+	Manifest current;
+
+public:
+	// compare content hashes too, not only size, mtime and inode
+	bool hash;
+
+	IncrementalState() : hash(false) {}
+
+	inline Manifest &getPrevious() { return previous; }
+	inline const Manifest &getCurrent() const { return current; }
+
+	// records the entry in the new manifest, returns false if it is unchanged since the
+	// previous one; directories are always kept so that the tree can be rebuilt
+	bool keep(archive_entry *e, bool hashed, uint64_t contentHash)
+	{
+		ManifestRecord rec;
+		rec.size      = archive_entry_size(e);
+		rec.mtime     = archive_entry_mtime(e);
+		rec.mtimeNsec = archive_entry_mtime_nsec(e);
+		rec.ino	      = archive_entry_ino64(e);
+		rec.hashed    = hashed;
+		rec.hash      = contentHash;
+		std::string path = archive_entry_pathname(e);
+		auto old	 = previous.find(path);
+		bool changed	 = old == previous.end() || archive_entry_filetype(e) == AE_IFDIR ||
+			       old->second.size != rec.size || old->second.mtime != rec.mtime ||
+			       old->second.mtimeNsec != rec.mtimeNsec || old->second.ino != rec.ino ||
+			       (hash && (!old->second.hashed || !hashed || old->second.hash != rec.hash));
+		current[std::move(path)] = rec;
+		return changed;
+	}
+
+	// escaped paths of the previous manifest that were not seen in this run, one per line
+	std::string deleted() const
+	{
+		std::vector<std::string> paths;
+		for(auto &rec : previous) {
+			if(!current.count(rec.first)) paths.push_back(rec.first);
+		}
+		std::sort(paths.begin(), paths.end());
+		std::string res;
+		for(auto &path : paths) res += manifestEscape(path) + '\n';
+		return res;
+	}
+};
+
+// Writes the deleted paths member; always present, so that readers know the archive is
+// incremental even if nothing was deleted.
+static bool writeIncrementalDeleted(VarArchive *ar, const IncrementalState &state,
+				    ArchiveStatus &status)
+{
+	return writeArchiveMember(ar, INCREMENTAL_DELETED_MEMBER, state.deleted(), status);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////// Incremental Reads ///////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+static inline bool isIncrementalDeleted(archive_entry *e)
+{
+	const char *path = archive_entry_pathname(e);
+	return path && strcmp(path, INCREMENTAL_DELETED_MEMBER) == 0;
+}
+
+// Reads the current entry's data as the deleted paths list.
+static bool readIncrementalDeleted(archive *a, std::vector<std::string> &paths,
+				   ArchiveStatus &status)
+{
+	std::string data;
+	char buf[16384];
+	la_ssize_t len;
+	while((len = archive_read_data(a, buf, sizeof(buf))) > 0) data.append(buf, len);
+	if(len < 0) {
+		status.fail("extract - reading deleted paths failed: " + archiveErrStr(a),
+			    ARCHIVE_FATAL);
+		return false;
+	}
+	std::istringstream lines(data);
+	std::string line;
+	while(std::getline(lines, line)) {
+		if(!line.empty()) paths.push_back(manifestUnescape(line));
+	}
+	return true;
+}
+
+// Removes `path` the way archive_write_disk would write it under the EXTRACT_SECURE_* `flags`:
+// absolute paths and ".." components are refused if asked to, and with SECURE_SYMLINKS the
+// parents are opened one by one without following symlinks, so none can be swapped in between.
+static void removeDeletedPath(const std::string &path, int flags, ArchiveStatus &status)
+{
+	std::vector<std::string> parts;
+	for(size_t begin = 0, end; begin <= path.size(); begin = end + 1) {
+		end = path.find('/', begin);
+		if(end == std::string::npos) end = path.size();
+		std::string part = path.substr(begin, end - begin);
+		if(part.empty() || part == ".") continue;
+		if(part == ".." && (flags & ARCHIVE_EXTRACT_SECURE_NODOTDOT)) {
+			status.fail("extract - refusing to remove '" + path + "': path contains '..'",
+				    ARCHIVE_WARN);
+			return;
+		}
+		parts.push_back(std::move(part));
+	}
+	bool absolute = !path.empty() && path[0] == '/';
+	if(absolute && (flags & ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS)) {
+		status.fail("extract - refusing to remove '" + path + "': path is absolute",
+			    ARCHIVE_WARN);
+		return;
+	}
+	if(parts.empty()) return;
+
+	const int dirFlags = O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+			     (flags & ARCHIVE_EXTRACT_SECURE_SYMLINKS ? O_NOFOLLOW : 0);
+	int dir = absolute ? open("/", dirFlags) : AT_FDCWD;
+	for(size_t i = 0; dir != -1 && i + 1 < parts.size(); ++i) {
+		int next = openat(dir, parts[i].c_str(), dirFlags);
+		int err	 = errno;
+		if(dir != AT_FDCWD) close(dir);
+		dir   = next;
+		errno = err;
+	}
+	if(dir == -1) {
+		// a missing parent means the path is already gone
+		if(errno == ENOENT) return;
+		status.fail("extract - refusing to remove '" + path + "': " +
+			    (errno == ELOOP ? "path goes through a symlink" : strerror(errno)),
+			    ARCHIVE_WARN);
+		return;
+	}
+	struct stat st;
+	const char *name = parts.back().c_str();
+	int res		 = fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW);
+	if(res == 0) res = unlinkat(dir, name, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0);
+	if(res != 0 && errno != ENOENT) {
+		status.fail("extract - failed to remove deleted '" + path + "': " + strerror(errno),
+			    ARCHIVE_WARN);
+	}
+	if(dir != AT_FDCWD) close(dir);
+}
+
+// Removes the (already rewritten) deleted paths; contents are removed before their directories.
+// The paths come from the archive, so they are checked like entries under the extract `flags`.
+static void applyIncrementalDeleted(std::vector<std::string> &paths, int flags,
+				    ArchiveStatus &status)
+{
+	std::sort(paths.rbegin(), paths.rend());
+	for(auto &path : paths) removeDeletedPath(path, flags, status);
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Entry metadata in columns, so that listing creates no object per entry.
+struct ListColumns
+{
+	std::vector<std::string> paths;
+	std::vector<int64_t> sizes;
+	std::vector<int64_t> types;
+	std::vector<int64_t> perms;
+	std::vector<int64_t> mtimes;
+
+	void add(std::string &&path, int64_t size, int64_t type, int64_t perm, int64_t mtime)
+	{
+		paths.push_back(std::move(path));
+		sizes.push_back(size);
+		types.push_back(type);
+		perms.push_back(perm);
+		mtimes.push_back(mtime);
+	}
+};
+
+static inline uint64_t zipGet(const unsigned char *p, int bytes)
+{
+	uint64_t val = 0;
+	for(int i = 0; i < bytes; ++i) val |= (uint64_t)p[i] << (i * 8);
+	return val;
+}
+
+static bool preadFull(int fd, void *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t res;
+	while(done < len && (res = pread(fd, (char *)buf + done, len - done, offset + done)) > 0) {
+		done += res;
+	}
+	return done == len;
+}
+
+static int64_t zipDosTime(uint64_t time, uint64_t date)
+{
+	struct tm tm = {};
+	tm.tm_year   = ((date >> 9) & 0x7f) + 80;
+	tm.tm_mon    = ((date >> 5) & 0x0f) - 1;
+	tm.tm_mday   = date & 0x1f;
+	tm.tm_hour   = (time >> 11) & 0x1f;
+	tm.tm_min    = (time >> 5) & 0x3f;
+	tm.tm_sec    = (time << 1) & 0x3e;
+	tm.tm_isdst  = -1;
+	return mktime(&tm);
+}
+
+// Lists a zip file straight from its central directory, without touching any local headers.
+// Returns false if the file is not a (plain, non self-extracting) zip, in which case the caller
+// falls back to libarchive. `out` is left untouched unless the whole directory was read.
+static bool listZipDirectory(const std::string &path, ListColumns &out)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+	struct stat st;
+	bool ok = false;
+	ListColumns cols;
+	std::vector<unsigned char> tail, dir;
+	uint64_t entries, dirSize, dirOffset;
+	const unsigned char *eocd = nullptr, *p, *end;
+	size_t tailLen;
+
+	if(fstat(fd, &st) != 0 || st.st_size < 22) goto done;
+	// end of central directory record: 22 bytes plus a comment of up to 64KiB
+	tailLen = std::min((off_t)(22 + 0xffff), st.st_size);
+	tail.resize(tailLen);
+	if(!preadFull(fd, tail.data(), tailLen, st.st_size - tailLen)) goto done;
+	for(size_t i = tailLen - 22 + 1; i-- > 0;) {
+		if(zipGet(&tail[i], 4) == 0x06054b50) {
+			eocd = &tail[i];
+			break;
+		}
+	}
+	if(!eocd) goto done;
+	entries	  = zipGet(eocd + 10, 2);
+	dirSize	  = zipGet(eocd + 12, 4);
+	dirOffset = zipGet(eocd + 16, 4);
+	if(entries == 0xffff || dirSize == 0xffffffff || dirOffset == 0xffffffff) {
+		// zip64: the locator precedes the end of central directory record
+		unsigned char z64[56];
+		off_t eocdPos = st.st_size - tailLen + (eocd - tail.data());
+		if(eocdPos < 20 || !preadFull(fd, z64, 20, eocdPos - 20) ||
+		   zipGet(z64, 4) != 0x07064b50)
+		{
+			goto done;
+		}
+		off_t z64Pos = zipGet(z64 + 8, 8);
+		if(!preadFull(fd, z64, 56, z64Pos) || zipGet(z64, 4) != 0x06064b50) goto done;
+		entries	  = zipGet(z64 + 32, 8);
+		dirSize	  = zipGet(z64 + 40, 8);
+		dirOffset = zipGet(z64 + 48, 8);
+	}
+	if(dirOffset + dirSize > (uint64_t)st.st_size) goto done;
+	dir.resize(dirSize);
+	if(!preadFull(fd, dir.data(), dirSize, dirOffset)) goto done;
+
+	p   = dir.data();
+	end = dir.data() + dir.size();
+	for(uint64_t i = 0; i < entries; ++i) {
+		if(end - p < 46 || zipGet(p, 4) != 0x02014b50) goto done;
+		uint64_t madeBy	   = zipGet(p + 4, 2) >> 8;
+		int64_t mtime	   = zipDosTime(zipGet(p + 12, 2), zipGet(p + 14, 2));
+		uint64_t size	   = zipGet(p + 24, 4);
+		uint64_t nameLen   = zipGet(p + 28, 2);
+		uint64_t extraLen  = zipGet(p + 30, 2);
+		uint64_t commentLen = zipGet(p + 32, 2);
+		uint64_t attrs	   = zipGet(p + 38, 4);
+		if((uint64_t)(end - p) < 46 + nameLen + extraLen + commentLen) goto done;
+		std::string name((const char *)p + 46, nameLen);
+
+		const unsigned char *extra = p + 46 + nameLen;
+		const unsigned char *extraEnd = extra + extraLen;
+		while(extraEnd - extra >= 4) {
+			uint64_t id  = zipGet(extra, 2);
+			uint64_t len = zipGet(extra + 2, 2);
+			if((uint64_t)(extraEnd - extra - 4) < len) break;
+			if(id == 0x0001 && size == 0xffffffff && len >= 8) {
+				size = zipGet(extra + 4, 8); // zip64 sizes, uncompressed first
+			} else if(id == 0x5455 && len >= 5 && (extra[4] & 1)) {
+				mtime = (int32_t)zipGet(extra + 5, 4); // extended timestamp
+			}
+			extra += 4 + len;
+		}
+
+		int64_t mode = 0;
+		if(madeBy == 3) mode = attrs >> 16; // unix
+		int64_t type = mode & AE_IFMT;
+		if(type == 0) type = !name.empty() && name.back() == '/' ? AE_IFDIR : AE_IFREG;
+		int64_t perm = mode & 07777;
+		if(perm == 0) perm = type == AE_IFDIR ? 0755 : 0644;
+		if(type == AE_IFDIR) size = 0;
+		cols.add(std::move(name), size, type, perm, mtime);
+		p += 46 + nameLen + extraLen + commentLen;
+	}
+	ok  = true;
+	out = std::move(cols);
+done:
+	close(fd);
+	return ok;
+}
+
+// Lists the remaining entries through libarchive, skipping over their data (a seek for
+// uncompressed archives opened from files).
+static bool listArchive(archive *a, ArchiveStats &stats, ListColumns &cols, std::string &err)
+{
+	archive_entry *entry;
+	for(;;) {
+		int code = timed(stats.archiveNs, [&] { return archive_read_next_header(a, &entry); });
+		if(code == ARCHIVE_EOF) return true;
+		if(code < ARCHIVE_WARN) {
+			err = "list - read_next_header failed: " + archiveErrStr(a);
+			return false;
+		}
+		const char *path = archive_entry_pathname(entry);
+		cols.add(path ? path : "", archive_entry_size(entry), archive_entry_filetype(entry),
+			 archive_entry_perm(entry), archive_entry_mtime(entry));
+		++stats.entries;
+		if(timed(stats.archiveNs, [&] { return archive_read_data_skip(a); }) < ARCHIVE_WARN) {
+			err = "list - read_data_skip failed: " + archiveErrStr(a);
+			return false;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns a map of parallel vectors: path, size, type, perm, mtime. Zip files that have not
+// been read from yet, by readers set up for FORMAT_ZIP alone and no filters, are listed from
+// their central directory alone.
+Var *feralArchiveList(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+		      const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	if(ar->getMode() != OM_READ) {
+		vm.fail(loc, "list - archive is not in read mode");
+		return nullptr;
+	}
+	ListColumns cols;
+	bool direct = ar->isZipOnly() && ar->isUnread() && !ar->getPath().empty() &&
+		      timed(ar->getStats().ioNs, [&] { return listZipDirectory(ar->getPath(), cols); });
+	if(direct) ar->getStats().entries += cols.paths.size();
+	else {
+		std::string err;
+		ar->nextReadGen();
+		if(!listArchive(ar->get(), ar->getStats(), cols, err)) {
+			vm.fail(loc, err);
+			return nullptr;
+		}
+	}
+
+	size_t count  = cols.paths.size();
+	VarVec *paths = vm.makeVarWithRef<VarVec>(loc, count, false);
+	VarVec *sizes = vm.makeVarWithRef<VarVec>(loc, count, false);
+	VarVec *types = vm.makeVarWithRef<VarVec>(loc, count, false);
+	VarVec *perms = vm.makeVarWithRef<VarVec>(loc, count, false);
+	VarVec *mtimes = vm.makeVarWithRef<VarVec>(loc, count, false);
+	for(size_t i = 0; i < count; ++i) {
+		paths->get().push_back(vm.makeVarWithRef<VarStr>(loc, cols.paths[i]));
+		sizes->get().push_back(vm.makeVarWithRef<VarInt>(loc, cols.sizes[i]));
+		types->get().push_back(vm.makeVarWithRef<VarInt>(loc, cols.types[i]));
+		perms->get().push_back(vm.makeVarWithRef<VarInt>(loc, cols.perms[i]));
+		mtimes->get().push_back(vm.makeVarWithRef<VarInt>(loc, cols.mtimes[i]));
+	}
+	VarMap *res = vm.makeVar<VarMap>(loc, 5, false);
+	res->get().insert({"path", paths});
+	res->get().insert({"size", sizes});
+	res->get().insert({"type", types});
+	res->get().insert({"perm", perms});
+	res->get().insert({"mtime", mtimes});
+	return res;
+}
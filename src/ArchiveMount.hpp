@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "ArchiveIO.hpp"
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Mount Class //////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// upper bound on the memory reserved from an entry's header size before its data is read
+static const size_t MOUNT_SIZE_HINT_MAX = 16 * 1024 * 1024;
+
+struct MountEntry
+{
+	// position of the entry in the archive, counting from 0
+	size_t index;
+	la_int64_t size;
+	int type;
+	int perm;
+	int64_t mtime;
+};
+
+// Read-only view of an archive file for serving its members by path. The paths are indexed once;
+// a member's data is decoded on first use and kept in a size-bounded LRU cache of whole members.
+// Decoding happens on a handle of the mount's own, set up like the archive it was mounted from,
+// which stays at the last member read so that members in archive order never decode twice.
+class ArchiveMount
+{
+	std::string path;
+	std::vector<ArchiveSetupFn> setup;
+	size_t blockSize;
+	std::vector<char> readBuf;
+	ArchiveStats stats;
+
+	std::unordered_map<std::string, MountEntry> entries;
+
+	archive *cursor;
+	FileSource *cursorClient;
+	// index of the entry the next archive_read_next_header() of the cursor returns
+	size_t cursorNext;
+
+	struct CachedMember
+	{
+		size_t index;
+		std::shared_ptr<const std::string> data;
+	};
+	// most recently used first
+	std::list<CachedMember> lru;
+	std::unordered_map<size_t, std::list<CachedMember>::iterator> cached;
+	size_t cacheCap;
+	size_t cacheUsed;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t opens;
+
+	void closeCursor()
+	{
+		if(!cursor) return;
+		archive_read_free(cursor);
+		// the client is only deleted after the handle that calls it
+		delete cursorClient;
+		cursor	     = nullptr;
+		cursorClient = nullptr;
+	}
+
+	// opens the file again on a new handle, positioned before the first entry
+	bool reopen(std::string &err)
+	{
+		closeCursor();
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) {
+			err = "failed to open archive '" + path + "': " + strerror(errno);
+			return false;
+		}
+		FileSource *src = new FileSource(fd, readBuf, blockSize);
+		src->setStats(&stats);
+		cursor	     = archive_read_new();
+		cursorClient = src;
+		cursorNext   = 0;
+		for(auto &step : setup) step(cursor);
+		if(timed(stats.archiveNs, [&] { return src->open(cursor); }) != ARCHIVE_OK) {
+			err = "failed to open archive '" + path + "': " + archiveErrStr(cursor);
+			closeCursor();
+			return false;
+		}
+		++opens;
+		return true;
+	}
+
+	void insert(size_t index, std::shared_ptr<const std::string> data)
+	{
+		// a member that fills the cache on its own would only evict everything else
+		if(data->size() > cacheCap) return;
+		while(cacheUsed + data->size() > cacheCap && !lru.empty()) {
+			cacheUsed -= lru.back().data->size();
+			cached.erase(lru.back().index);
+			lru.pop_back();
+			++evictions;
+		}
+		lru.push_front({index, data});
+		cached[index] = lru.begin();
+		cacheUsed += data->size();
+	}
+
+	// decodes the data of the entry at index, moving the cursor past it
+	std::shared_ptr<const std::string> decode(const MountEntry &entry, std::string &err)
+	{
+		if((!cursor || cursorNext > entry.index) && !reopen(err)) return nullptr;
+		archive_entry *e;
+		while(cursorNext <= entry.index) {
+			int code = timed(stats.archiveNs,
+					 [&] { return archive_read_next_header(cursor, &e); });
+			if(code == ARCHIVE_EOF) {
+				err = "archive '" + path + "' changed since it was mounted";
+				closeCursor();
+				return nullptr;
+			}
+			if(code < ARCHIVE_WARN) {
+				err = "read_next_header failed: " + archiveErrStr(cursor);
+				closeCursor();
+				return nullptr;
+			}
+			++cursorNext;
+		}
+		std::shared_ptr<std::string> data = std::make_shared<std::string>();
+		// header sizes are only a hint, corrupt ones must not allocate up front
+		data->resize(std::min(entry.size > 0 ? (size_t)entry.size : 0, MOUNT_SIZE_HINT_MAX));
+		size_t done = 0;
+		la_ssize_t len;
+		for(;;) {
+			// sizes may be unknown up front (streamed zip members)
+			if(done == data->size()) data->resize(done + 64 * 1024);
+			len = timed(stats.archiveNs, [&] {
+				return archive_read_data(cursor, &(*data)[done], data->size() - done);
+			});
+			if(len <= 0) break;
+			done += len;
+		}
+		if(len < 0) {
+			err = "failed to read '" + path + "': " + archiveErrStr(cursor);
+			closeCursor();
+			return nullptr;
+		}
+		data->resize(done);
+		stats.bytes += done;
+		++stats.entries;
+		return data;
+	}
+
+public:
+	ArchiveMount(const std::string &path, const std::vector<ArchiveSetupFn> &setup,
+		     size_t blockSize, size_t cacheCap)
+		: path(path), setup(setup), blockSize(blockSize), cursor(nullptr), cursorClient(nullptr),
+		  cursorNext(0), cacheCap(cacheCap), cacheUsed(0), hits(0), misses(0), evictions(0),
+		  opens(0)
+	{}
+	~ArchiveMount() { closeCursor(); }
+
+	// paths inside the archive compare without a leading "./" or "/" and a trailing "/"
+	static std::string normalize(const char *p)
+	{
+		std::string res(p ? p : "");
+		size_t begin = 0;
+		while(begin < res.size()) {
+			if(res.compare(begin, 2, "./") == 0) begin += 2;
+			else if(res[begin] == '/') ++begin;
+			else break;
+		}
+		size_t end = res.size();
+		while(end > begin && res[end - 1] == '/') --end;
+		return res.substr(begin, end - begin);
+	}
+
+	// reads all the headers once; hardlinks share the index of the entry they link to
+	bool build(std::string &err)
+	{
+		if(!reopen(err)) return false;
+		archive_entry *e;
+		for(;;) {
+			int code = timed(stats.archiveNs,
+					 [&] { return archive_read_next_header(cursor, &e); });
+			if(code == ARCHIVE_EOF) break;
+			if(code < ARCHIVE_WARN) {
+				err = "read_next_header failed: " + archiveErrStr(cursor);
+				closeCursor();
+				return false;
+			}
+			MountEntry entry{cursorNext++, archive_entry_size(e),
+					 (int)archive_entry_filetype(e), (int)archive_entry_perm(e),
+					 (int64_t)archive_entry_mtime(e)};
+			const char *target = archive_entry_hardlink(e);
+			if(target) {
+				auto found = entries.find(normalize(target));
+				if(found != entries.end()) entry = found->second;
+			}
+			// later entries with the same path replace earlier ones, as on extraction
+			entries[normalize(archive_entry_pathname(e))] = entry;
+		}
+		// the next read starts over anyway
+		closeCursor();
+		return true;
+	}
+
+	inline const MountEntry *find(const std::string &p) const
+	{
+		auto found = entries.find(normalize(p.c_str()));
+		return found == entries.end() ? nullptr : &found->second;
+	}
+
+	// data of a regular file entry, from the cache or decoded; nullptr with err set on failure
+	std::shared_ptr<const std::string> read(const MountEntry &entry, std::string &err)
+	{
+		auto found = cached.find(entry.index);
+		if(found != cached.end()) {
+			++hits;
+			lru.splice(lru.begin(), lru, found->second);
+			return found->second->data;
+		}
+		++misses;
+		std::shared_ptr<const std::string> data = decode(entry, err);
+		if(data) insert(entry.index, data);
+		return data;
+	}
+
+	inline size_t getEntryCount() const { return entries.size(); }
+	inline size_t getCacheCap() const { return cacheCap; }
+	inline size_t getCacheUsed() const { return cacheUsed; }
+	inline uint64_t getHits() const { return hits; }
+	inline uint64_t getMisses() const { return misses; }
+	inline uint64_t getEvictions() const { return evictions; }
+	inline uint64_t getOpens() const { return opens; }
+	inline ArchiveStats &getStats() { return stats; }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// mount(cacheSize = 64MiB, blockSize = 1MiB)
+// Indexes the paths of a reader opened with open(name) and returns an ArchiveMount serving its
+// members with readFile()/stat(). Members are decoded on the mount's own handle, set up with the
+// reader's filters and formats; the reader itself is left as it was.
+Var *feralArchiveMount(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+		       const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	if(ar->getMode() != OM_READ) {
+		vm.fail(loc, "only archives in read mode can be mounted");
+		return nullptr;
+	}
+	if(ar->getPath().empty()) {
+		vm.fail(loc, "mounting requires an archive opened from a file with open(name)");
+		return nullptr;
+	}
+	int64_t cacheSize = 64 * 1024 * 1024;
+	int64_t blockSize = 1024 * 1024;
+	if(!assnArgInt(vm, assn_args, "cacheSize", cacheSize) ||
+	   !assnArgInt(vm, assn_args, "blockSize", blockSize))
+	{
+		return nullptr;
+	}
+	if(cacheSize < 0 || blockSize <= 0) {
+		vm.fail(loc, "cache size must not be negative and block size must be positive");
+		return nullptr;
+	}
+	std::shared_ptr<ArchiveMount> mount =
+	std::make_shared<ArchiveMount>(ar->getPath(), ar->getSetup(), blockSize, cacheSize);
+	std::string err;
+	if(!mount->build(err)) {
+		vm.fail(loc, "mount - ", err);
+		return nullptr;
+	}
+	return vm.makeVar<VarArchiveMount>(loc, mount);
+}
+
+// readFile(path)
+// Data of the regular file at path as a string, or nil if the archive has no such entry.
+Var *feralArchiveMountReadFile(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			       const StringMap<AssnArgData> &assn_args)
+{
+	ArchiveMount &mount = as<VarArchiveMount>(args[0])->get();
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected path to be of type 'str', found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	const std::string &path = as<VarStr>(args[1])->get();
+	const MountEntry *entry = mount.find(path);
+	if(!entry) return vm.getNil();
+	if(entry->type != AE_IFREG) {
+		vm.fail(loc, "readFile - '", path, "' is not a regular file");
+		return nullptr;
+	}
+	std::string err;
+	std::shared_ptr<const std::string> data = mount.read(*entry, err);
+	if(!data) {
+		vm.fail(loc, "readFile - ", err);
+		return nullptr;
+	}
+	return vm.makeVar<VarStr>(loc, *data);
+}
+
+// stat(path)
+// Map of size, filetype, perm and mtime of the entry at path, or nil if there is none.
+Var *feralArchiveMountStat(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			   const StringMap<AssnArgData> &assn_args)
+{
+	ArchiveMount &mount = as<VarArchiveMount>(args[0])->get();
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected path to be of type 'str', found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	const MountEntry *entry = mount.find(as<VarStr>(args[1])->get());
+	if(!entry) return vm.getNil();
+	VarMap *res = vm.makeVar<VarMap>(loc, 4, false);
+	res->get().insert({"size", vm.makeVarWithRef<VarInt>(loc, entry->size)});
+	res->get().insert({"filetype", vm.makeVarWithRef<VarInt>(loc, entry->type)});
+	res->get().insert({"perm", vm.makeVarWithRef<VarInt>(loc, entry->perm)});
+	res->get().insert({"mtime", vm.makeVarWithRef<VarInt>(loc, entry->mtime)});
+	return res;
+}
+
+// Cache counters for tuning cacheSize: hits and misses of readFile(), members evicted, bytes
+// cached, and times the archive was opened (once for the index, then for each backward read).
+Var *feralArchiveMountStats(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			    const StringMap<AssnArgData> &assn_args)
+{
+	ArchiveMount &mount = as<VarArchiveMount>(args[0])->get();
+	ArchiveStats &stats = mount.getStats();
+
+	VarMap *res = vm.makeVar<VarMap>(loc, 10, false);
+	res->get().insert({"entries", vm.makeVarWithRef<VarInt>(loc, mount.getEntryCount())});
+	res->get().insert({"hits", vm.makeVarWithRef<VarInt>(loc, mount.getHits())});
+	res->get().insert({"misses", vm.makeVarWithRef<VarInt>(loc, mount.getMisses())});
+	res->get().insert({"evictions", vm.makeVarWithRef<VarInt>(loc, mount.getEvictions())});
+	res->get().insert({"cachedBytes", vm.makeVarWithRef<VarInt>(loc, mount.getCacheUsed())});
+	res->get().insert({"cacheSize", vm.makeVarWithRef<VarInt>(loc, mount.getCacheCap())});
+	res->get().insert({"opens", vm.makeVarWithRef<VarInt>(loc, mount.getOpens())});
+	res->get().insert({"decodedBytes", vm.makeVarWithRef<VarInt>(loc, stats.bytes)});
+	res->get().insert({"archiveNs", vm.makeVarWithRef<VarInt>(loc, stats.archiveNs)});
+	res->get().insert({"ioNs", vm.makeVarWithRef<VarInt>(loc, stats.ioNs)});
+	return res;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////// Bounded Queue //////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Blocking multi-producer/multi-consumer queue bounded by the total cost of the queued items
+// (bytes for data blocks). An item larger than the capacity is still accepted when the queue is
+// empty so that producers can never deadlock on a single oversized item.
+template<typename T> class BoundedQueue
+{
+	std::mutex mtx;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+	std::deque<std::pair<T, size_t>> items;
+	size_t used;
+	size_t cap;
+	bool closed;
+
+public:
+	BoundedQueue(size_t cap) : used(0), cap(cap), closed(false) {}
+
+	// returns false if the queue was closed, in which case the item is dropped
+	bool push(T &&item, size_t cost = 1)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		notFull.wait(lock, [&] { return closed || used == 0 || used + cost <= cap; });
+		if(closed) return false;
+		items.emplace_back(std::move(item), cost);
+		used += cost;
+		notEmpty.notify_one();
+		return true;
+	}
+	// returns false once the queue is closed and drained
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+		if(items.empty()) return false;
+		item = std::move(items.front().first);
+		used -= items.front().second;
+		items.pop_front();
+		notFull.notify_all();
+		return true;
+	}
+	// wakes up all waiters; pending items can still be popped
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+};
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#include "ArchiveIO.hpp"
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////// Member Index //////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Seekable archives are tar streams compressed as a sequence of independent frames (zstd frames
+// or gzip members) that only start at entry boundaries. Since decoders treat concatenated frames
+// as one stream, the result is a regular .tar.zst/.tar.gz. The sidecar index (<archive>.idx)
+// maps each path to the compressed offset of its frame and the entry's offset inside the frame.
+
+struct SeekableIndexEntry
+{
+	uint64_t frameOffset;
+	uint64_t entryOffset;
+};
+
+using SeekableIndex = std::unordered_map<std::string, SeekableIndexEntry>;
+
+static const char SEEKABLE_INDEX_MAGIC[8] = {'F', 'E', 'R', 'A', 'I', 'D', 'X', '1'};
+
+static void seekableIndexPutInt(std::string &out, uint64_t val, int bytes)
+{
+	for(int i = 0; i < bytes; ++i) out.push_back((char)(val >> (i * 8)));
+}
+
+static uint64_t seekableIndexGetInt(const char *&in, int bytes)
+{
+	uint64_t val = 0;
+	for(int i = 0; i < bytes; ++i) val |= (uint64_t)(unsigned char)in[i] << (i * 8);
+	in += bytes;
+	return val;
+}
+
+// modification time of a stat result; macOS names the field differently
+static inline const struct timespec &statMtime(const struct stat &st)
+{
+#if defined(__APPLE__)
+	return st.st_mtimespec;
+#else
+	return st.st_mtim;
+#endif
+}
+
+// Loaded indices, keyed by index file; reloaded when the file's size or mtime changes.
+struct SeekableIndexCache
+{
+	struct Cached
+	{
+		off_t size;
+		struct timespec mtime;
+		std::shared_ptr<const SeekableIndex> index;
+	};
+	std::mutex mtx;
+	std::unordered_map<std::string, Cached> indices;
+};
+
+static std::shared_ptr<const SeekableIndex> loadSeekableIndex(const std::string &file,
+							      std::string &err)
+{
+	static SeekableIndexCache cache;
+
+	struct stat st;
+	if(stat(file.c_str(), &st) != 0) {
+		err = "failed to stat index '" + file + "': " + strerror(errno);
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> lock(cache.mtx);
+	auto found = cache.indices.find(file);
+	if(found != cache.indices.end() && found->second.size == st.st_size &&
+	   found->second.mtime.tv_sec == statMtime(st).tv_sec &&
+	   found->second.mtime.tv_nsec == statMtime(st).tv_nsec)
+	{
+		return found->second.index;
+	}
+
+	std::string data(st.st_size, '\0');
+	int fd = open(file.c_str(), O_RDONLY);
+	if(fd < 0) {
+		err = "failed to open index '" + file + "': " + strerror(errno);
+		return nullptr;
+	}
+	size_t done = 0;
+	ssize_t len;
+	while(done < data.size() && (len = read(fd, &data[done], data.size() - done)) > 0) {
+		done += len;
+	}
+	close(fd);
+	if(done != data.size() || data.size() < sizeof(SEEKABLE_INDEX_MAGIC) ||
+	   memcmp(data.data(), SEEKABLE_INDEX_MAGIC, sizeof(SEEKABLE_INDEX_MAGIC)) != 0)
+	{
+		err = "'" + file + "' is not a valid archive index";
+		return nullptr;
+	}
+
+	std::shared_ptr<SeekableIndex> index = std::make_shared<SeekableIndex>();
+	const char *in	= data.data() + sizeof(SEEKABLE_INDEX_MAGIC);
+	const char *end = data.data() + data.size();
+	while(end - in >= 20) {
+		SeekableIndexEntry entry;
+		entry.frameOffset = seekableIndexGetInt(in, 8);
+		entry.entryOffset = seekableIndexGetInt(in, 8);
+		uint64_t pathLen  = seekableIndexGetInt(in, 4);
+		if((uint64_t)(end - in) < pathLen) break;
+		// later entries with the same path replace earlier ones, as on extraction
+		(*index)[std::string(in, pathLen)] = entry;
+		in += pathLen;
+	}
+	if(in != end) {
+		err = "archive index '" + file + "' is truncated";
+		return nullptr;
+	}
+	cache.indices[file] = {st.st_size, statMtime(st), index};
+	return index;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////// Clients ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Receives the uncompressed tar stream of a writer and compresses it frame by frame. Data is
+// streamed through the current frame's compressor as it arrives; a frame is closed at the first
+// entry boundary after frameSize uncompressed bytes, so a large member never sits in memory.
+class SeekableSink : public ArchiveClient
+{
+	std::string name;
+	int fd;
+	int filter;
+	size_t frameSize;
+	// compressor of the current frame, nullptr between frames
+	archive *frame;
+	// uncompressed bytes written to the current frame
+	uint64_t frameBytes;
+	// compressed offset where the current (or next) frame starts, and bytes written so far
+	uint64_t frameOffset;
+	uint64_t written;
+	std::string index;
+
+	// output of the frame compressors, straight to the file
+	static la_ssize_t output(archive *w, void *self, const void *buff, size_t len)
+	{
+		SeekableSink *sink = (SeekableSink *)self;
+		size_t done	   = 0;
+		ssize_t res;
+		while(done < len) {
+			res = timed(sink->stats->ioNs, [&] {
+				return ::write(sink->fd, (const char *)buff + done, len - done);
+			});
+			if(res < 0 && errno == EINTR) continue;
+			if(res <= 0) {
+				archive_set_error(w, errno, "failed to write frame to '%s'",
+						  sink->name.c_str());
+				return ARCHIVE_FATAL;
+			}
+			done += res;
+		}
+		sink->written += len;
+		return len;
+	}
+
+	int failFrame(archive *a, const char *what)
+	{
+		archive_set_error(a, archive_errno(frame), "failed to %s frame: %s", what,
+				  archiveErrStr(frame).c_str());
+		archive_write_free(frame);
+		frame = nullptr;
+		return ARCHIVE_FATAL;
+	}
+
+	// starts a complete, standalone stream of the filter; concatenated, the frames decode as one
+	int openFrame(archive *a)
+	{
+		frame		 = archive_write_new();
+		archive_entry *e = archive_entry_new();
+		archive_write_add_filter(frame, filter);
+		archive_write_set_format_raw(frame);
+		// no block padding, it would end up between the frames
+		archive_write_set_bytes_per_block(frame, 0);
+		archive_entry_set_filetype(e, AE_IFREG);
+		int code = archive_write_open(frame, this, nullptr, output, nullptr);
+		if(code == ARCHIVE_OK) code = archive_write_header(frame, e);
+		archive_entry_free(e);
+		if(code != ARCHIVE_OK) return failFrame(a, "start");
+		frameOffset = written;
+		frameBytes  = 0;
+		return ARCHIVE_OK;
+	}
+
+	// ends the current frame's stream, flushing it to the file
+	int closeFrame(archive *a)
+	{
+		if(!frame) return ARCHIVE_OK;
+		if(archive_write_close(frame) != ARCHIVE_OK) return failFrame(a, "finish");
+		archive_write_free(frame);
+		frame	    = nullptr;
+		frameOffset = written;
+		frameBytes  = 0;
+		return ARCHIVE_OK;
+	}
+
+public:
+	SeekableSink(const std::string &name, int fd, int filter, size_t frameSize)
+		: name(name), fd(fd), filter(filter), frameSize(frameSize), frame(nullptr),
+		  frameBytes(0), frameOffset(0), written(0),
+		  index(SEEKABLE_INDEX_MAGIC, sizeof(SEEKABLE_INDEX_MAGIC))
+	{}
+	~SeekableSink()
+	{
+		if(frame) archive_write_free(frame);
+		if(fd >= 0) ::close(fd);
+	}
+
+	int beforeHeader(archive *a, archive_entry *entry)
+	{
+		// pads the previous entry so that the frame ends exactly on the boundary
+		int code = archive_write_finish_entry(a);
+		if(code < ARCHIVE_WARN) return code;
+		if(frameBytes >= frameSize && (code = closeFrame(a)) != ARCHIVE_OK) return code;
+		const char *path = archive_entry_pathname(entry);
+		size_t pathLen	 = path ? strlen(path) : 0;
+		seekableIndexPutInt(index, frameOffset, 8);
+		seekableIndexPutInt(index, frameBytes, 8);
+		seekableIndexPutInt(index, pathLen, 4);
+		index.append(path ? path : "", pathLen);
+		return ARCHIVE_OK;
+	}
+
+	static la_ssize_t write(archive *a, void *self, const void *buff, size_t len)
+	{
+		SeekableSink *sink = (SeekableSink *)self;
+		if(!sink->frame && sink->openFrame(a) != ARCHIVE_OK) return ARCHIVE_FATAL;
+		if(archive_write_data(sink->frame, buff, len) < 0) {
+			sink->failFrame(a, "compress");
+			return ARCHIVE_FATAL;
+		}
+		sink->frameBytes += len;
+		return len;
+	}
+	static int close(archive *a, void *self)
+	{
+		SeekableSink *sink = (SeekableSink *)self;
+		int code	   = sink->closeFrame(a);
+		::close(sink->fd);
+		sink->fd = -1;
+		if(code != ARCHIVE_OK) return code;
+
+		std::string idxName = sink->name + ".idx";
+		int idx		    = ::open(idxName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(idx < 0) {
+			archive_set_error(a, errno, "failed to create index '%s'", idxName.c_str());
+			return ARCHIVE_FATAL;
+		}
+		size_t done = 0;
+		ssize_t res;
+		while(done < sink->index.size()) {
+			res = ::write(idx, sink->index.data() + done, sink->index.size() - done);
+			if(res < 0 && errno == EINTR) continue;
+			if(res <= 0) {
+				archive_set_error(a, errno, "failed to write index '%s'",
+						  idxName.c_str());
+				::close(idx);
+				return ARCHIVE_FATAL;
+			}
+			done += res;
+		}
+		if(::close(idx) != 0) {
+			archive_set_error(a, errno, "failed to write index '%s'", idxName.c_str());
+			return ARCHIVE_FATAL;
+		}
+		return ARCHIVE_OK;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// openSeekable(name, filter, frameSize = 4MiB)
+// Opens a writer whose output can be read from any indexed member with openMember(). The filter
+// is applied per frame, so it must be passed here instead of through addFilter().
+Var *feralArchiveOpenSeekable(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected a string file name to open as archive");
+		return nullptr;
+	}
+	if(!args[2]->is<VarInt>()) {
+		vm.fail(args[2]->getLoc(), "expected filter id to be of type 'int', found: ",
+			vm.getTypeName(args[2]));
+		return nullptr;
+	}
+	if(ar->getMode() != OM_WRITE) {
+		vm.fail(loc, "seekable archives can only be opened in write mode");
+		return nullptr;
+	}
+	int filter = as<VarInt>(args[2])->get();
+	if(filter != ARCHIVE_FILTER_ZSTD && filter != ARCHIVE_FILTER_GZIP) {
+		vm.fail(args[2]->getLoc(), "seekable archives support FILTER_ZSTD and FILTER_GZIP");
+		return nullptr;
+	}
+	if((archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) != ARCHIVE_FORMAT_TAR) {
+		vm.fail(loc, "seekable archives require one of the FORMAT_TAR_* formats");
+		return nullptr;
+	}
+	if(archive_filter_count(a) > 0 && archive_filter_code(a, 0) != ARCHIVE_FILTER_NONE) {
+		vm.fail(loc, "seekable archives compress per frame, use openSeekable()'s filter"
+			     " argument instead of addFilter()");
+		return nullptr;
+	}
+	int64_t frameSize = 4 * 1024 * 1024;
+	if(!assnArgInt(vm, assn_args, "frameSize", frameSize)) return nullptr;
+	if(frameSize <= 0) {
+		vm.fail(loc, "frame size must be positive, found: ", frameSize);
+		return nullptr;
+	}
+
+	const std::string &name = as<VarStr>(args[1])->get();
+	int fd			= open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		vm.fail(loc, "failed to create archive '", name, "': ", strerror(errno));
+		return nullptr;
+	}
+	SeekableSink *sink = new SeekableSink(name, fd, filter, frameSize);
+	ar->setOpened();
+	ar->setClient(sink);
+	// unblocked, so that entry boundaries reach the sink as they happen
+	archive_write_set_bytes_per_block(a, 0);
+	if(archive_write_open(a, sink, nullptr, SeekableSink::write, SeekableSink::close) !=
+	   ARCHIVE_OK)
+	{
+		vm.fail(loc, "failed to open archive in given mode: ", archive_error_string(a));
+		return nullptr;
+	}
+	return args[0];
+}
+
+// openMember(name, path, blockSize = 1MiB)
+// Opens a seekable archive at the frame holding `path` using its index, and returns the member's
+// entry. Its data can then be read with readBlock()/readData(). Only the frames from the member
+// onwards are ever read, so the reader must be reset() before the next lookup.
+Var *feralArchiveOpenMember(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			    const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	archive *a     = ar->get();
+
+	if(!args[1]->is<VarStr>()) {
+		vm.fail(args[1]->getLoc(), "expected a string file name to open as archive");
+		return nullptr;
+	}
+	if(!args[2]->is<VarStr>()) {
+		vm.fail(args[2]->getLoc(), "expected member path to be of type 'str', found: ",
+			vm.getTypeName(args[2]));
+		return nullptr;
+	}
+	if(ar->getMode() != OM_READ) {
+		vm.fail(loc, "archive members can only be opened in read mode");
+		return nullptr;
+	}
+	int64_t blockSize = 1024 * 1024;
+	if(!assnArgInt(vm, assn_args, "blockSize", blockSize)) return nullptr;
+	if(blockSize <= 0) {
+		vm.fail(loc, "block size must be positive, found: ", blockSize);
+		return nullptr;
+	}
+
+	const std::string &name = as<VarStr>(args[1])->get();
+	const std::string &path = as<VarStr>(args[2])->get();
+	std::string err;
+	std::shared_ptr<const SeekableIndex> index = loadSeekableIndex(name + ".idx", err);
+	if(!index) {
+		vm.fail(loc, err);
+		return nullptr;
+	}
+	auto found = index->find(path);
+	if(found == index->end()) {
+		vm.fail(loc, "member '", path, "' not found in the index of '", name, "'");
+		return nullptr;
+	}
+
+	int fd = open(name.c_str(), O_RDONLY);
+	if(fd < 0 || lseek(fd, found->second.frameOffset, SEEK_SET) < 0) {
+		vm.fail(loc, "failed to open archive '", name, "': ", strerror(errno));
+		if(fd >= 0) close(fd);
+		return nullptr;
+	}
+	FileSource *src = new FileSource(fd, ar->getReadBuffer(), blockSize);
+	ar->setOpened();
+	ar->setClient(src);
+	// header positions are relative to the frame, so seeking would be off
+	archive_read_set_read_callback(a, FileSource::read);
+	archive_read_set_callback_data(a, src);
+	if(archive_read_open1(a) != ARCHIVE_OK) {
+		vm.fail(loc, "failed to open archive in given mode: ", archive_error_string(a));
+		return nullptr;
+	}
+
+	// the frame may begin with other entries; header positions are relative to the frame
+	archive_entry *entry;
+	ar->nextReadGen();
+	for(;;) {
+		int code = archive_read_next_header(a, &entry);
+		if(code == ARCHIVE_EOF) break;
+		if(code < ARCHIVE_WARN) {
+			vm.fail(loc, "read_next_header failed: ", archive_error_string(a));
+			return nullptr;
+		}
+		la_int64_t pos = archive_read_header_position(a);
+		if(pos == (la_int64_t)found->second.entryOffset) {
+			if(path != archive_entry_pathname(entry)) break;
+			return vm.makeVar<VarArchiveEntry>(loc, archive_entry_clone(entry), true);
+		}
+		if(pos > (la_int64_t)found->second.entryOffset) break;
+	}
+	vm.fail(loc, "index of '", name, "' does not match the archive at member '", path, "'");
+	return nullptr;
+}
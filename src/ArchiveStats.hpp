@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns the archive's counters as a map:
+// entries, bytes - entries and entry data bytes read or written
+// compressedBytes, uncompressedBytes - bytes on either side of the filters
+// archiveNs - time in libarchive, of which ioNs was spent in the module's I/O callbacks
+// diskNs - time reading (add*) or writing (extract) files on disk, summed across threads
+// Like resetStats() and setProgress(), not available while an async task runs on the archive:
+// use the task's progress() instead.
+Var *feralArchiveStats(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+		       const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar	    = as<VarArchive>(args[0]);
+	ArchiveStats &stats = ar->getStats();
+	// -1 if the archive was never opened
+	la_int64_t compressed	= std::max(archive_filter_bytes(ar->get(), -1), (la_int64_t)0);
+	la_int64_t uncompressed = std::max(archive_filter_bytes(ar->get(), 0), (la_int64_t)0);
+
+	VarMap *res = vm.makeVar<VarMap>(loc, 7, false);
+	res->get().insert({"entries", vm.makeVarWithRef<VarInt>(loc, stats.entries)});
+	res->get().insert({"bytes", vm.makeVarWithRef<VarInt>(loc, stats.bytes)});
+	res->get().insert({"compressedBytes", vm.makeVarWithRef<VarInt>(loc, compressed)});
+	res->get().insert({"uncompressedBytes", vm.makeVarWithRef<VarInt>(loc, uncompressed)});
+	res->get().insert({"archiveNs", vm.makeVarWithRef<VarInt>(loc, stats.archiveNs)});
+	res->get().insert({"ioNs", vm.makeVarWithRef<VarInt>(loc, stats.ioNs)});
+	res->get().insert({"diskNs", vm.makeVarWithRef<VarInt>(loc, stats.diskNs)});
+	return res;
+}
+
+Var *feralArchiveResetStats(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			    const StringMap<AssnArgData> &assn_args)
+{
+	as<VarArchive>(args[0])->getStats().reset();
+	return args[0];
+}
+
+// setProgress(fn, every = 1MiB)
+// fn(bytes, entries) is called from the calling thread each time another `every` bytes of entry
+// data went through the archive; returning false stops the operation. nil removes the callback.
+Var *feralArchiveSetProgress(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			     const StringMap<AssnArgData> &assn_args)
+{
+	VarArchive *ar = as<VarArchive>(args[0]);
+	if(args[1]->is<VarNil>()) {
+		ar->setProgress(nullptr, 0);
+		return args[0];
+	}
+	if(!args[1]->isCallable()) {
+		vm.fail(args[1]->getLoc(), "expected a callable progress function, found: ",
+			vm.getTypeName(args[1]));
+		return nullptr;
+	}
+	int64_t every = 1 << 20;
+	if(!assnArgInt(vm, assn_args, "every", every)) return nullptr;
+	if(every <= 0) {
+		vm.fail(loc, "progress interval must be positive, found: ", every);
+		return nullptr;
+	}
+	ar->setProgress(args[1], every);
+	return args[0];
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "ArchiveUtils.hpp"
+
+using ArchiveFn = Var *(*)(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			   const StringMap<AssnArgData> &assn_args);
+
+// Wraps the bindings that use the archive's handle, which belongs to the async task running on
+// the archive, if any, until the task is done.
+template<ArchiveFn fn>
+Var *whenIdle(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+	      const StringMap<AssnArgData> &assn_args)
+{
+	if(as<VarArchive>(args[0])->isBusy()) {
+		vm.fail(loc, "archive is in use by an async task, wait() for it first");
+		return nullptr;
+	}
+	return fn(vm, loc, args, assn_args);
+}
+
+// Wraps the open*() bindings. A libarchive handle is opened only once: opening it again fails
+// without calling the new client, and leaves the handle with the old one, which setClient() has
+// deleted by then. The bindings call setOpened() right before opening the handle.
+template<ArchiveFn fn>
+Var *whenUnopened(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+		  const StringMap<AssnArgData> &assn_args)
+{
+	if(as<VarArchive>(args[0])->isOpened()) {
+		vm.fail(loc, "archive was opened before, reset() it to open it again");
+		return nullptr;
+	}
+	return fn(vm, loc, args, assn_args);
+}
+
+// archives opened with openCallback() can only do I/O on the calling thread
+static bool callsFeral(VarArchive *ar)
+{
+	return ar && ar->getClient() && ar->getClient()->callsFeral();
+}
+
+// Runs op on a worker thread as the task of the archive (and of source, if any). op gets the
+// task's status, which cancel() aborts, and must not use any Feral object: only the archives'
+// handles and stats, and what it captured by value.
+static VarArchiveTask *startArchiveTask(Interpreter &vm, ModuleLoc loc, VarArchive *ar,
+					std::function<int(ArchiveStatus &status)> op,
+					VarArchive *source = nullptr)
+{
+	if(callsFeral(ar) || callsFeral(source)) {
+		vm.fail(loc, "archives opened with openCallback() cannot be used by async tasks");
+		return nullptr;
+	}
+	std::shared_ptr<ArchiveStatus> status = std::make_shared<ArchiveStatus>();
+	VarArchiveTask *task		      = vm.makeVar<VarArchiveTask>(loc, ar, source);
+	// blocks handed out before are invalid once the task reads
+	ar->nextReadGen();
+	if(source) source->nextReadGen();
+	task->start(
+	[status, op](std::vector<std::string> &errors) {
+		int code = op(*status);
+		std::lock_guard<std::mutex> lock(status->mtx);
+		errors = status->errors;
+		if(status->aborted) return status->fatalCode;
+		return code == ARCHIVE_OK && !errors.empty() ? ARCHIVE_WARN : code;
+	},
+	[status]() { status->fail("task cancelled", ARCHIVE_FATAL); });
+	return task;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns true once the operation is done, without blocking.
+Var *feralArchiveTaskPoll(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	ArchiveTaskState &state = as<VarArchiveTask>(args[0])->getState();
+	if(!state.done) return vm.getFalse();
+	state.join();
+	return vm.getTrue();
+}
+
+// Blocks until the operation is done and returns its libarchive code. Its errors are reported by
+// the first wait() only.
+Var *feralArchiveTaskWait(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			  const StringMap<AssnArgData> &assn_args)
+{
+	ArchiveTaskState &state = as<VarArchiveTask>(args[0])->getState();
+	state.join();
+	if(!state.reported) {
+		state.reported = true;
+		for(auto &err : state.errors) vm.fail(loc, err);
+	}
+	return vm.makeVar<VarInt>(loc, state.code);
+}
+
+// Asks the operation to stop at the next entry or data block; wait() then returns ARCHIVE_FATAL.
+Var *feralArchiveTaskCancel(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			    const StringMap<AssnArgData> &assn_args)
+{
+	ArchiveTaskState &state = as<VarArchiveTask>(args[0])->getState();
+	if(!state.done && state.canceller) state.canceller();
+	return args[0];
+}
+
+// Returns a map of: bytes, entries - the archive's counters so far, done - as poll()
+Var *feralArchiveTaskProgress(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			      const StringMap<AssnArgData> &assn_args)
+{
+	ArchiveTaskState &state = as<VarArchiveTask>(args[0])->getState();
+	ArchiveStats &stats	= state.ar->getStats();
+	VarMap *res		= vm.makeVar<VarMap>(loc, 3, false);
+	res->get().insert({"bytes", vm.makeVarWithRef<VarInt>(loc, stats.bytes)});
+	res->get().insert({"entries", vm.makeVarWithRef<VarInt>(loc, stats.entries)});
+	res->get().insert({"done", vm.makeVarWithRef<VarBool>(loc, state.done)});
+	return res;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <thread>
+
+#include "ArchiveDisk.hpp"
+#include "ArchiveExtract.hpp"
+#include "ArchiveTask.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A unit of work handed from the decompressing reader to the compressing writer: one HEADER
+// per entry followed by its DATA blocks.
+struct TranscodeMsg
+{
+	enum Kind
+	{
+		HEADER,
+		DATA,
+	} kind;
+	EntryPtr entry;
+	std::vector<char> data;
+	la_int64_t offset;
+
+	TranscodeMsg() : kind(HEADER), offset(0) {}
+	TranscodeMsg(Kind kind) : kind(kind), offset(0) {}
+};
+
+// Reads the selected entries into the queue; runs on its own thread.
+static void transcodeReader(VarArchive *reader, const ExtractOptions &opts,
+			    BoundedQueue<TranscodeMsg> &queue, ArchiveStatus &status)
+{
+	archive *a	    = reader->get();
+	ArchiveStats &stats = reader->getStats();
+	ExtractFilter filter(opts);
+	archive_entry *entry;
+	const void *buff;
+	size_t size;
+	la_int64_t offset;
+	int code = ARCHIVE_OK;
+	while(!status.aborted) {
+		code = timed(stats.archiveNs, [&] { return archive_read_next_header(a, &entry); });
+		if(code == ARCHIVE_EOF) break;
+		if(code < ARCHIVE_OK) {
+			status.fail("transcode - read_next_header failed: " + archiveErrStr(a), code);
+		}
+		if(code < ARCHIVE_WARN) break;
+		if(!filter.apply(entry)) {
+			code = timed(stats.archiveNs, [&] { return archive_read_data_skip(a); });
+			if(code < ARCHIVE_OK) {
+				status.fail("transcode - read_data_skip failed: " + archiveErrStr(a),
+					    code);
+			}
+			if(code < ARCHIVE_WARN) break;
+			continue;
+		}
+		++stats.entries;
+		TranscodeMsg header(TranscodeMsg::HEADER);
+		header.entry.reset(archive_entry_clone(entry));
+		// holes are written as zeros, as the output format may not support sparse entries
+		archive_entry_sparse_clear(header.entry.get());
+		bool hasData = archive_entry_size(entry) > 0;
+		if(!queue.push(std::move(header))) break;
+		while(hasData && !status.aborted) {
+			code = timed(stats.archiveNs,
+				     [&] { return archive_read_data_block(a, &buff, &size, &offset); });
+			if(code == ARCHIVE_EOF) {
+				code = ARCHIVE_OK;
+				break;
+			}
+			if(code < ARCHIVE_OK) {
+				status.fail("transcode - read_data_block failed: " + archiveErrStr(a),
+					    code);
+				if(code < ARCHIVE_WARN) break;
+			}
+			TranscodeMsg block(TranscodeMsg::DATA);
+			block.data.assign((const char *)buff, (const char *)buff + size);
+			block.offset = offset;
+			stats.bytes += size;
+			if(!queue.push(std::move(block), size)) break;
+		}
+		if(code < ARCHIVE_WARN) break;
+	}
+	if(code >= ARCHIVE_WARN && !status.aborted) filter.reportUnmatched(status);
+	queue.close();
+}
+
+// Writes a header held back until the entry's first data block is known, so that adaptive zip
+// writers can sample it.
+static bool transcodeHeader(VarArchive *writer, EntryPtr &pending, const TranscodeMsg *block,
+			    ArchiveStatus &status)
+{
+	if(!pending) return true;
+	archive *a = writer->get();
+	if(writer->isAdaptive()) {
+		chooseZipCompression(a, pending.get(), block ? block->data.data() : nullptr,
+				     block ? block->data.size() : 0, -1);
+	}
+	int code = writeArchiveHeader(writer, pending.get());
+	if(code < ARCHIVE_OK) {
+		status.fail(std::string("transcode - failed to write header for '") +
+			    archive_entry_pathname(pending.get()) + "': " + archiveErrStr(a),
+			    code);
+	}
+	pending.reset();
+	return code >= ARCHIVE_WARN;
+}
+
+// Moves the entries selected by opts from reader to writer, decompressing on a reader thread
+// while the calling thread compresses; at most opts.queueSize bytes are buffered in between.
+static int transcodeArchive(VarArchive *reader, VarArchive *writer, const ExtractOptions &opts,
+			    ArchiveStatus &status)
+{
+	ArchiveStats &stats = writer->getStats();
+	BoundedQueue<TranscodeMsg> queue(opts.queueSize);
+	std::thread readerThread(transcodeReader, reader, std::cref(opts), std::ref(queue),
+				 std::ref(status));
+
+	TranscodeMsg msg;
+	EntryPtr pending;
+	// position in the current entry's data, for padding holes
+	la_int64_t pos = 0;
+	bool ok	       = true;
+	while(ok && !status.aborted && queue.pop(msg)) {
+		if(msg.kind == TranscodeMsg::HEADER) {
+			ok	= transcodeHeader(writer, pending, nullptr, status);
+			pending = std::move(msg.entry);
+			pos	= 0;
+			continue;
+		}
+		ok = transcodeHeader(writer, pending, &msg, status);
+		if(ok && msg.offset > pos) ok = writeZeros(writer, msg.offset - pos, status);
+		if(ok) ok = writeArchiveData(writer, msg.data.data(), msg.data.size(), status);
+		pos = msg.offset + msg.data.size();
+		if(ok && !stats.report()) {
+			status.fail("transcode - stopped by progress callback", ARCHIVE_FATAL);
+			ok = false;
+		}
+	}
+	if(ok && !status.aborted) transcodeHeader(writer, pending, nullptr, status);
+	// also releases the reader if it waits for room
+	queue.close();
+	readerThread.join();
+	if(status.aborted) return status.fatalCode;
+	return status.errors.empty() ? ARCHIVE_OK : ARCHIVE_WARN;
+}
+
+static bool parseTranscodeArgs(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			       const StringMap<AssnArgData> &assn_args, ExtractOptions &opts)
+{
+	if(!args[1]->is<VarArchive>() || as<VarArchive>(args[1])->getMode() != OM_READ) {
+		vm.fail(args[1]->getLoc(), "expected an archive opened for reading, found: ",
+			vm.getTypeName(args[1]));
+		return false;
+	}
+	if(!args[2]->is<VarArchive>() || as<VarArchive>(args[2])->getMode() != OM_WRITE) {
+		vm.fail(args[2]->getLoc(), "expected an archive opened for writing, found: ",
+			vm.getTypeName(args[2]));
+		return false;
+	}
+	if(as<VarArchive>(args[1])->isBusy() || as<VarArchive>(args[2])->isBusy()) {
+		vm.fail(loc, "archive is in use by an async task, wait() for it first");
+		return false;
+	}
+	int64_t queueSize = opts.queueSize;
+	int64_t strip	  = opts.strip;
+	if(!assnArgInt(vm, assn_args, "queueSize", queueSize) ||
+	   !assnArgStrVec(vm, assn_args, "include", opts.include) ||
+	   !assnArgStrVec(vm, assn_args, "exclude", opts.exclude) ||
+	   !assnArgStrVec(vm, assn_args, "paths", opts.paths) ||
+	   !assnArgInt(vm, assn_args, "strip", strip) ||
+	   !assnArgStr(vm, assn_args, "prefix", opts.prefix))
+	{
+		return false;
+	}
+	if(queueSize <= 0 || strip < 0) {
+		vm.fail(loc, "transcode - queue size must be positive and strip count not negative");
+		return false;
+	}
+	opts.queueSize = queueSize;
+	opts.strip     = strip;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////// Functions ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// transcode(reader, writer, queueSize = 64MiB, include = vec, exclude = vec, paths = vec,
+//	     strip = 0, prefix = '')
+// Copies the entries of reader to writer without extracting them, with selection and renaming
+// as in extract(). Returns the libarchive code; the writer still has to be closed.
+Var *feralArchiveTranscode(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+			   const StringMap<AssnArgData> &assn_args)
+{
+	ExtractOptions opts;
+	if(!parseTranscodeArgs(vm, loc, args, assn_args, opts)) return nullptr;
+	VarArchive *reader = as<VarArchive>(args[1]);
+	VarArchive *writer = as<VarArchive>(args[2]);
+	// the reader runs on its own thread
+	if(callsFeral(reader)) {
+		vm.fail(loc, "transcode cannot read from an archive opened with openCallback()");
+		return nullptr;
+	}
+	ArchiveStatus status;
+	ProgressScope progress(vm, loc, writer);
+	reader->nextReadGen();
+	int code = transcodeArchive(reader, writer, opts, status);
+	for(auto &err : status.errors) vm.fail(loc, err);
+	return vm.makeVar<VarInt>(loc, code);
+}
+
+// transcodeAsync(reader, writer, ...) -> ArchiveTask
+// Same arguments as transcode(), which runs on a worker thread; progress() follows the writer.
+Var *feralArchiveTranscodeAsync(Interpreter &vm, ModuleLoc loc, Span<Var *> args,
+				const StringMap<AssnArgData> &assn_args)
+{
+	ExtractOptions opts;
+	if(!parseTranscodeArgs(vm, loc, args, assn_args, opts)) return nullptr;
+	VarArchive *reader = as<VarArchive>(args[1]);
+	VarArchive *writer = as<VarArchive>(args[2]);
+	return startArchiveTask(
+	vm, loc, writer,
+	[reader, writer, opts](ArchiveStatus &status) {
+		return transcodeArchive(reader, writer, opts, status);
+	},
+	reader);
+}
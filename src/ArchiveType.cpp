@@ -1,11 +1,32 @@
 #include "ArchiveType.hpp"
 
+#include <algorithm>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////// Archive Stats //////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+ArchiveStats::ArchiveStats() { reset(); }
+
+void ArchiveStats::reset()
+{
+	entries	     = 0;
+	bytes	     = 0;
+	archiveNs    = 0;
+	ioNs	     = 0;
+	diskNs	     = 0;
+	progressNext = 0;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////// Archive Class //////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
 VarArchive::VarArchive(ModuleLoc loc, archive *const val, int mode, bool owner)
-	: Var(loc, false, false), val(val), mode((OpenMode)mode), owner(owner)
+	: Var(loc, false, false), val(val), client(nullptr), checksums(nullptr), links(nullptr),
+	  progressFn(nullptr), progressEvery(0), mode((OpenMode)mode), readGen(0), firstGen(0),
+	  adaptive(false), busy(std::make_shared<std::atomic<bool>>(false)),
+	  opened(std::make_shared<bool>(false)), owner(owner)
 {}
 VarArchive::~VarArchive()
 {
@@ -13,16 +34,116 @@ VarArchive::~VarArchive()
 		if(mode == OM_READ) archive_read_free(val);
 		else if(mode == OM_WRITE) archive_write_free(val);
 	}
+	// freeing the archive may still invoke the client's close callback
+	if(owner) delete client;
+	// like resolvers, checksums are never shared between copies
+	delete checksums;
+	if(links) archive_entry_linkresolver_free(links);
+	if(progressFn) decref(progressFn);
 }
 
-Var *VarArchive::copy(ModuleLoc loc) { return new VarArchive(loc, val, mode, false); }
+Var *VarArchive::copy(ModuleLoc loc)
+{
+	VarArchive *res = new VarArchive(loc, val, mode, false);
+	res->client	= client;
+	res->path	= path;
+	res->adaptive	= adaptive;
+	res->busy	= busy;
+	res->opened	= opened;
+	return res;
+}
 
 void VarArchive::set(Var *from)
 {
-	if(owner && val) archive_read_free(val);
-	owner = false;
-	mode  = as<VarArchive>(from)->mode;
-	val   = as<VarArchive>(from)->val;
+	if(owner && val) {
+		if(mode == OM_READ) archive_read_free(val);
+		else if(mode == OM_WRITE) archive_write_free(val);
+	}
+	if(owner) delete client;
+	// resolvers and checksums are never shared between copies
+	if(links) archive_entry_linkresolver_free(links);
+	delete checksums;
+	owner	  = false;
+	links	  = nullptr;
+	checksums = nullptr;
+	contents.clear();
+	setup.clear();
+	formats.clear();
+	filters.clear();
+	mode	 = as<VarArchive>(from)->mode;
+	val	 = as<VarArchive>(from)->val;
+	client	 = as<VarArchive>(from)->client;
+	path	 = as<VarArchive>(from)->path;
+	busy	 = as<VarArchive>(from)->busy;
+	opened	 = as<VarArchive>(from)->opened;
+	adaptive = as<VarArchive>(from)->adaptive;
+	stats.reset();
+}
+
+void VarArchive::setClient(ArchiveClient *newClient)
+{
+	if(owner) delete client;
+	client = newClient;
+	if(client) client->setStats(&stats);
+	// blocks may point into the previous client's buffers
+	firstGen = ++readGen;
+}
+
+void VarArchive::setChecksums(ArchiveChecksums *newChecksums)
+{
+	delete checksums;
+	checksums = newChecksums;
+}
+
+void VarArchive::setProgress(Var *fn, uint64_t every)
+{
+	if(fn) incref(fn);
+	if(progressFn) decref(progressFn);
+	progressFn    = fn;
+	progressEvery = every;
+}
+
+archive_entry_linkresolver *VarArchive::getLinkResolver()
+{
+	if(links) return links;
+	links = archive_entry_linkresolver_new();
+	archive_entry_linkresolver_set_strategy(links, archive_format(val));
+	return links;
+}
+
+int VarArchive::applySetup(const ArchiveSetupFn &step)
+{
+	int code = step(val);
+	if(code >= ARCHIVE_WARN) setup.push_back(step);
+	return code;
+}
+
+bool VarArchive::isZipOnly() const
+{
+	return formats.size() == 1 && formats[0] == ARCHIVE_FORMAT_ZIP &&
+	       std::all_of(filters.begin(), filters.end(),
+			   [](int filter) { return filter == ARCHIVE_FILTER_NONE; });
+}
+
+bool VarArchive::reset()
+{
+	// libarchive handles cannot be reopened once closed
+	archive *fresh = mode == OM_READ ? archive_read_new() : archive_write_new();
+	if(fresh == nullptr) return false;
+	if(mode == OM_READ) archive_read_free(val);
+	else archive_write_free(val);
+	delete client;
+	val    = fresh;
+	client = nullptr;
+	for(auto &step : setup) step(val);
+	if(links) archive_entry_linkresolver_free(links);
+	links = nullptr;
+	contents.clear();
+	path.clear();
+	if(checksums) checksums->restart();
+	*opened	 = false;
+	firstGen = ++readGen;
+	return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -32,7 +153,10 @@ void VarArchive::set(Var *from)
 VarArchiveEntry::VarArchiveEntry(ModuleLoc loc, archive_entry *const val, bool owner)
 	: Var(loc, false, false), val(val), owner(owner)
 {}
-VarArchiveEntry::~VarArchiveEntry() { archive_entry_free(val); }
+VarArchiveEntry::~VarArchiveEntry()
+{
+	if(owner && val) archive_entry_free(val);
+}
 
 Var *VarArchiveEntry::copy(ModuleLoc loc) { return new VarArchiveEntry(loc, val, false); }
 
@@ -42,3 +166,98 @@ void VarArchiveEntry::set(Var *from)
 	owner = false;
 	val   = as<VarArchiveEntry>(from)->val;
 }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////// Archive Block Class ////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+VarArchiveBlock::VarArchiveBlock(ModuleLoc loc, VarArchive *ar, const void *data, size_t len,
+				 la_int64_t offset)
+	: Var(loc, false, false), ar(ar), data((const char *)data), len(len), offset(offset),
+	  gen(ar->getReadGen())
+{
+	incref(ar);
+}
+VarArchiveBlock::~VarArchiveBlock() { decref(ar); }
+
+Var *VarArchiveBlock::copy(ModuleLoc loc)
+{
+	VarArchiveBlock *res = new VarArchiveBlock(loc, ar, data, len, offset);
+	res->gen	     = gen;
+	return res;
+}
+
+void VarArchiveBlock::set(Var *from)
+{
+	VarArchiveBlock *blk = as<VarArchiveBlock>(from);
+	incref(blk->ar);
+	decref(ar);
+	ar     = blk->ar;
+	data   = blk->data;
+	len    = blk->len;
+	offset = blk->offset;
+	gen    = blk->gen;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////// Archive Task Class ////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+ArchiveTaskState::ArchiveTaskState(VarArchive *ar, VarArchive *source)
+	: ar(ar), source(source), done(false), code(ARCHIVE_OK), reported(false)
+{
+	incref(ar);
+	if(source) incref(source);
+}
+ArchiveTaskState::~ArchiveTaskState()
+{
+	if(worker.joinable() && !done && canceller) canceller();
+	join();
+	decref(ar);
+	if(source) decref(source);
+}
+
+void ArchiveTaskState::join()
+{
+	if(!worker.joinable()) return;
+	worker.join();
+	ar->setBusy(false);
+	if(source) source->setBusy(false);
+}
+
+VarArchiveTask::VarArchiveTask(ModuleLoc loc, VarArchive *ar, VarArchive *source)
+	: Var(loc, false, false), state(std::make_shared<ArchiveTaskState>(ar, source))
+{}
+
+VarArchiveTask::VarArchiveTask(ModuleLoc loc, std::shared_ptr<ArchiveTaskState> state)
+	: Var(loc, false, false), state(std::move(state))
+{}
+
+Var *VarArchiveTask::copy(ModuleLoc loc) { return new VarArchiveTask(loc, state); }
+
+void VarArchiveTask::set(Var *from) { state = as<VarArchiveTask>(from)->state; }
+
+void VarArchiveTask::start(std::function<int(std::vector<std::string> &errors)> op,
+			   std::function<void()> canceller)
+{
+	ArchiveTaskState *s = state.get();
+	s->canceller	    = std::move(canceller);
+	s->ar->setBusy(true);
+	if(s->source) s->source->setBusy(true);
+	s->worker = std::thread([s, op]() {
+		s->code = op(s->errors);
+		s->done = true;
+	});
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////// Archive Mount Class ////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+VarArchiveMount::VarArchiveMount(ModuleLoc loc, std::shared_ptr<ArchiveMount> mount)
+	: Var(loc, false, false), mount(std::move(mount))
+{}
+
+Var *VarArchiveMount::copy(ModuleLoc loc) { return new VarArchiveMount(loc, mount); }
+
+void VarArchiveMount::set(Var *from) { mount = as<VarArchiveMount>(from)->mount; }
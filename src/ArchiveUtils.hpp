@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ArchiveType.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////// Keyword Arguments ///////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// returns the value of keyword argument `name`, or nullptr if it was not passed
+static Var *findAssnArg(const StringMap<AssnArgData> &assn_args, const char *name)
+{
+	auto it = assn_args.find(name);
+	if(it == assn_args.end()) return nullptr;
+	return it->second.val;
+}
+
+// the assnArg* getters leave `out` untouched if the argument was not passed,
+// and return false (after failing the vm) if it was passed with the wrong type
+
+static bool assnArgInt(Interpreter &vm, const StringMap<AssnArgData> &assn_args,
+		       const char *name, int64_t &out)
+{
+	Var *v = findAssnArg(assn_args, name);
+	if(!v) return true;
+	if(!v->is<VarInt>()) {
+		vm.fail(v->getLoc(), "expected '", name,
+			"' to be of type 'int', found: ", vm.getTypeName(v));
+		return false;
+	}
+	out = as<VarInt>(v)->get();
+	return true;
+}
+
+static bool assnArgBool(Interpreter &vm, const StringMap<AssnArgData> &assn_args,
+			const char *name, bool &out)
+{
+	Var *v = findAssnArg(assn_args, name);
+	if(!v) return true;
+	if(!v->is<VarBool>()) {
+		vm.fail(v->getLoc(), "expected '", name,
+			"' to be of type 'bool', found: ", vm.getTypeName(v));
+		return false;
+	}
+	out = as<VarBool>(v)->get();
+	return true;
+}
+
+static bool assnArgStr(Interpreter &vm, const StringMap<AssnArgData> &assn_args,
+		       const char *name, std::string &out)
+{
+	Var *v = findAssnArg(assn_args, name);
+	if(!v) return true;
+	if(!v->is<VarStr>()) {
+		vm.fail(v->getLoc(), "expected '", name,
+			"' to be of type 'str', found: ", vm.getTypeName(v));
+		return false;
+	}
+	out = as<VarStr>(v)->get();
+	return true;
+}
+
+static bool assnArgStrVec(Interpreter &vm, const StringMap<AssnArgData> &assn_args,
+			  const char *name, std::vector<std::string> &out)
+{
+	Var *v = findAssnArg(assn_args, name);
+	if(!v) return true;
+	if(!v->is<VarVec>()) {
+		vm.fail(v->getLoc(), "expected '", name,
+			"' to be a vector of strings, found: ", vm.getTypeName(v));
+		return false;
+	}
+	for(auto &e : as<VarVec>(v)->get()) {
+		if(!e->is<VarStr>()) {
+			vm.fail(e->getLoc(), "expected '", name,
+				"' to contain only strings, found: ", vm.getTypeName(e));
+			return false;
+		}
+		out.push_back(as<VarStr>(e)->get());
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////// Helpers /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Errors of a native operation, collected so that they can be reported from the interpreter
+// thread. A code below ARCHIVE_WARN aborts the operation.
+struct ArchiveStatus
+{
+	std::mutex mtx;
+	std::vector<std::string> errors;
+	std::atomic<bool> aborted;
+	int fatalCode;
+
+	ArchiveStatus() : aborted(false), fatalCode(ARCHIVE_OK) {}
+
+	void fail(const std::string &msg, int code)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		errors.push_back(msg);
+		if(code < ARCHIVE_WARN && !aborted) {
+			fatalCode = code;
+			aborted	  = true;
+		}
+	}
+};
+
+struct EntryDeleter
+{
+	void operator()(archive_entry *e) { archive_entry_free(e); }
+};
+using EntryPtr = std::unique_ptr<archive_entry, EntryDeleter>;
+
+static inline std::string archiveErrStr(archive *a)
+{
+	const char *err = archive_error_string(a);
+	return err ? err : "unknown error";
+}
+
+// returns fn(), adding the wall time it took to the `ns` counter of an ArchiveStats
+template<typename F> static inline auto timed(std::atomic<uint64_t> &ns, F fn) -> decltype(fn())
+{
+	struct Timer
+	{
+		std::atomic<uint64_t> &ns;
+		std::chrono::steady_clock::time_point start;
+		~Timer()
+		{
+			ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			      std::chrono::steady_clock::now() - start)
+			      .count();
+		}
+	} timer{ns, std::chrono::steady_clock::now()};
+	return fn();
+}
+
+// Routes the archive's progress reports to its Feral callback for the duration of a native call.
+// The callback receives (bytes, entries) and stops the operation by returning false.
+class ProgressScope
+{
+	ArchiveStats &stats;
+
+public:
+	ProgressScope(Interpreter &vm, ModuleLoc loc, VarArchive *ar) : stats(ar->getStats())
+	{
+		Var *fn = ar->getProgressFn();
+		if(!fn) return;
+		uint64_t every	   = ar->getProgressEvery();
+		stats.progressNext = stats.bytes + every;
+		stats.progress	   = [&vm, loc, fn, every, this]() {
+			stats.progressNext = stats.bytes + every;
+			Var *callArgs[3]   = {nullptr, vm.makeVarWithRef<VarInt>(loc, stats.bytes),
+					      vm.makeVarWithRef<VarInt>(loc, stats.entries)};
+			Var *res = vm.callVar(loc, "progress", fn, Span<Var *>{callArgs, 3}, {});
+			decref(callArgs[1]);
+			decref(callArgs[2]);
+			if(!res) return false;
+			bool ok = !res->is<VarBool>() || as<VarBool>(res)->get();
+			decref(res);
+			return ok;
+		};
+	}
+	~ProgressScope() { stats.progress = nullptr; }
+};
+
+// writes the header after giving the archive's client a chance to act on the entry boundary
+static int writeArchiveHeader(VarArchive *ar, archive_entry *entry)
+{
+	ArchiveStats &stats = ar->getStats();
+	if(ar->getClient()) {
+		int code = timed(stats.archiveNs,
+				 [&] { return ar->getClient()->beforeHeader(ar->get(), entry); });
+		if(code < ARCHIVE_OK) return code;
+	}
+	++stats.entries;
+	if(ar->getChecksums()) ar->getChecksums()->beginEntry(entry);
+	return timed(stats.archiveNs, [&] { return archive_write_header(ar->get(), entry); });
+}
+
+// writes entry data to the archive, counting it in the archive's stats and checksums
+static bool writeArchiveData(VarArchive *ar, const void *data, size_t len, ArchiveStatus &status)
+{
+	ArchiveStats &stats = ar->getStats();
+	if(timed(stats.archiveNs, [&] { return archive_write_data(ar->get(), data, len); }) < 0) {
+		status.fail("failed to write data: " + archiveErrStr(ar->get()), ARCHIVE_FATAL);
+		return false;
+	}
+	if(ar->getChecksums()) ar->getChecksums()->update(data, len);
+	stats.bytes += len;
+	return true;
+}
+
+// writes a regular file entry holding `data`, for the module's own members
+static bool writeArchiveMember(VarArchive *ar, const char *name, const std::string &data,
+			       ArchiveStatus &status)
+{
+	EntryPtr e(archive_entry_new());
+	archive_entry_set_pathname(e.get(), name);
+	archive_entry_set_filetype(e.get(), AE_IFREG);
+	archive_entry_set_perm(e.get(), 0644);
+	archive_entry_set_size(e.get(), data.size());
+	archive_entry_set_mtime(e.get(), time(nullptr), 0);
+	int code = writeArchiveHeader(ar, e.get());
+	if(code < ARCHIVE_OK) {
+		status.fail(std::string("failed to write header for '") + name +
+			    "': " + archiveErrStr(ar->get()),
+			    code);
+		if(code < ARCHIVE_WARN) return false;
+	}
+	return data.empty() || writeArchiveData(ar, data.data(), data.size(), status);
+}
+
+static bool writeZeros(VarArchive *ar, la_int64_t len, ArchiveStatus &status)
+{
+	static const char zeros[64 * 1024] = {};
+	while(len > 0) {
+		size_t chunk = std::min(len, (la_int64_t)sizeof(zeros));
+		if(!writeArchiveData(ar, zeros, chunk, status)) return false;
+		len -= chunk;
+	}
+	return true;
+}
+
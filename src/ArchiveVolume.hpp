@@ -0,0 +1,224 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ArchiveUtils.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////// Clients ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes the archive as numbered volumes - name.001, name.002, ... - of volumeSize bytes each,
+// the last one possibly shorter. A volume is only created once there is data for it.
+class VolumeSink : public ArchiveClient
+{
+	std::string name;
+	size_t volumeSize;
+	size_t volumes;
+	// bytes written to the current volume
+	size_t used;
+	int fd;
+
+	bool closeVolume(archive *a)
+	{
+		if(fd < 0) return true;
+		int res = ::close(fd);
+		fd	= -1;
+		if(res == 0) return true;
+		archive_set_error(a, errno, "failed to close volume %zu of '%s'", volumes,
+				  name.c_str());
+		return false;
+	}
+
+	bool nextVolume(archive *a)
+	{
+		if(!closeVolume(a)) return false;
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%03zu", ++volumes);
+		std::string path = name + suffix;
+		fd = timed(stats->ioNs, [&] {
+			return ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		});
+		if(fd < 0) {
+			archive_set_error(a, errno, "failed to create volume '%s'", path.c_str());
+			return false;
+		}
+		used = 0;
+		return true;
+	}
+
+public:
+	VolumeSink(const std::string &name, size_t volumeSize)
+		: name(name), volumeSize(volumeSize), volumes(0), used(0), fd(-1)
+	{}
+	~VolumeSink()
+	{
+		if(fd >= 0) ::close(fd);
+	}
+
+	static la_ssize_t write(archive *a, void *self, const void *buff, size_t len)
+	{
+		VolumeSink *sink = (VolumeSink *)self;
+		size_t done	 = 0;
+		while(done < len) {
+			if((sink->fd < 0 || sink->used == sink->volumeSize) && !sink->nextVolume(a)) {
+				return ARCHIVE_FATAL;
+			}
+			size_t chunk = std::min(len - done, sink->volumeSize - sink->used);
+			ssize_t res  = timed(sink->stats->ioNs, [&] {
+				return ::write(sink->fd, (const char *)buff + done, chunk);
+			});
+			if(res < 0 && errno == EINTR) continue;
+			if(res < 0) {
+				archive_set_error(a, errno, "failed to write volume %zu of '%s'",
+						  sink->volumes, sink->name.c_str());
+				return ARCHIVE_FATAL;
+			}
+			done += res;
+			sink->used += res;
+		}
+		return len;
+	}
+	static int close(archive *a, void *self)
+	{
+		return ((VolumeSink *)self)->closeVolume(a) ? ARCHIVE_OK : ARCHIVE_FATAL;
+	}
+};
+
+// Reads the archive from a list of volumes, in order. While one volume is being decompressed, the
+// next one is opened and its first block read on a background thread, hiding the latency of
+// opening files on network storage.
+class VolumeSource : public ArchiveClient
+{
+	struct Volume
+	{
+		int fd;
+		// errno of a failed open or read
+		int err;
+		// first block, read ahead of use
+		std::vector<char> head;
+		bool headRead;
+
+		Volume() : fd(-1), err(0), headRead(false) {}
+	};
+
+	std::vector<std::string> names;
+	std::vector<char> &buf;
+	size_t index;
+	Volume cur;
+	Volume next;
+	std::thread prefetcher;
+
+	static void load(const std::string &name, size_t blockSize, Volume &vol)
+	{
+		vol.fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+		if(vol.fd < 0) {
+			vol.err = errno;
+			return;
+		}
+		vol.head.resize(blockSize);
+		ssize_t len;
+		while((len = ::read(vol.fd, vol.head.data(), vol.head.size())) < 0 && errno == EINTR);
+		if(len < 0) vol.err = errno;
+		vol.head.resize(len > 0 ? len : 0);
+	}
+
+	void prefetch()
+	{
+		if(index + 1 >= names.size()) return;
+		next	   = Volume();
+		prefetcher =
+		std::thread(load, std::cref(names[index + 1]), buf.size(), std::ref(next));
+	}
+
+	// moves on to the prefetched volume; false at the end or on errors, set on the archive
+	bool advance(archive *a)
+	{
+		if(index + 1 >= names.size()) return false;
+		timed(stats->ioNs, [&] { prefetcher.join(); });
+		if(cur.fd >= 0) ::close(cur.fd);
+		cur	= std::move(next);
+		next.fd = -1;
+		++index;
+		if(cur.err) {
+			archive_set_error(a, cur.err, "failed to read volume '%s'",
+					  names[index].c_str());
+			return false;
+		}
+		prefetch();
+		return true;
+	}
+
+public:
+	VolumeSource(const std::vector<std::string> &names, std::vector<char> &buf, size_t blockSize)
+		: names(names), buf(buf), index(0)
+	{
+		buf.resize(blockSize);
+	}
+	~VolumeSource()
+	{
+		if(prefetcher.joinable()) prefetcher.join();
+		if(cur.fd >= 0) ::close(cur.fd);
+		if(next.fd >= 0) ::close(next.fd);
+	}
+
+	static int open(archive *a, void *self)
+	{
+		VolumeSource *src = (VolumeSource *)self;
+		timed(src->stats->ioNs, [&] { load(src->names[0], src->buf.size(), src->cur); });
+		if(src->cur.err) {
+			archive_set_error(a, src->cur.err, "failed to read volume '%s'",
+					  src->names[0].c_str());
+			return ARCHIVE_FATAL;
+		}
+		src->prefetch();
+		return ARCHIVE_OK;
+	}
+
+	static la_ssize_t read(archive *a, void *self, const void **buff)
+	{
+		VolumeSource *src = (VolumeSource *)self;
+		for(;;) {
+			Volume &cur = src->cur;
+			if(!cur.headRead) {
+				cur.headRead = true;
+				if(!cur.head.empty()) {
+					*buff = cur.head.data();
+					return cur.head.size();
+				}
+			}
+			*buff	    = src->buf.data();
+			ssize_t len = timed(src->stats->ioNs, [&] {
+				return ::read(cur.fd, src->buf.data(), src->buf.size());
+			});
+			if(len < 0 && errno == EINTR) continue;
+			if(len < 0) {
+				archive_set_error(a, errno, "failed to read volume '%s'",
+						  src->names[src->index].c_str());
+				return ARCHIVE_FATAL;
+			}
+			if(len > 0) return len;
+			if(src->index + 1 >= src->names.size()) return 0;
+			if(!src->advance(a)) return ARCHIVE_FATAL;
+		}
+	}
+	// skips within the current volume only; libarchive reads through the rest
+	static la_int64_t skip(archive *a, void *self, la_int64_t request)
+	{
+		VolumeSource *src = (VolumeSource *)self;
+		Volume &cur	  = src->cur;
+		struct stat st;
+		if(!cur.headRead || fstat(cur.fd, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+		off_t pos = lseek(cur.fd, 0, SEEK_CUR);
+		if(pos < 0) return 0;
+		la_int64_t len = std::min(request, (la_int64_t)(st.st_size - pos));
+		if(len <= 0 || lseek(cur.fd, len, SEEK_CUR) < 0) return 0;
+		return len;
+	}
+};